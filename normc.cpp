@@ -0,0 +1,57 @@
+// Client of the normd optimizer daemon. Sends a job given as key=value
+// arguments, for example
+//   ./normc layers=4 target=0.3 stagnation=100000
+// and prints the daemon's answers until the job is finished. The keys and
+// the answers are described in normd.cpp. Exits with 0 if a result was
+// received, otherwise 1.
+//
+// This work is placed in the public domain / CC0.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Options:
+//   --socket PATH   socket of the daemon, default normd.sock
+int main(int argc, char **argv) {
+  const char *socketPath = "normd.sock";
+  char line[1024] = "job";
+  for (int i = 1; i < argc; i++) {
+    if (i+1 < argc && !strcmp(argv[i], "--socket")) {
+      socketPath = argv[++i];
+    } else if (strlen(line) + strlen(argv[i]) + 3 < sizeof(line)) {
+      strcat(line, " ");
+      strcat(line, argv[i]);
+    }
+  }
+  strcat(line, "\n");
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socketPath, sizeof(address.sun_path)-1);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+    fprintf(stderr, "Could not connect to %s\n", socketPath);
+    return 1;
+  }
+  if (write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+    fprintf(stderr, "Could not send the job\n");
+    return 1;
+  }
+  // Print the answers, noting whether the last line is a result
+  FILE *answers = fdopen(fd, "r");
+  bool result = false;
+  char answer[16384];
+  while (fgets(answer, sizeof(answer), answers)) {
+    fputs(answer, stdout);
+    fflush(stdout);
+    result = !strncmp(answer, "result ", 7);
+  }
+  fclose(answers);
+  return result ? 0 : 1;
+}
+
+// Compile with:
+// g++ normc.cpp -O2 -o normc
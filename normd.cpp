@@ -0,0 +1,405 @@
+// Optimizer daemon. Accepts NormProblem jobs over a Unix domain socket,
+// runs them on a pool of worker threads, highest priority first and at
+// most a quota of jobs per client user at a time, and streams progress and
+// results back. Many small retuning jobs can share one process this way
+// instead of each starting its own.
+//
+// The protocol is lines of text. A client sends one line
+//   job key=value ...
+// with the keys (defaults in parentheses)
+//   priority      higher runs first (0)
+//   layers        number of layers (5)
+//   start, end    x interval (0.001, 1)
+//   multiplier    error multiplier (1.01)
+//   samples       number of samples (65537), at most 1048577
+//   evaluations, seconds, target, stagnation
+//                 stopping criteria as in optimize; stagnation 100000 if
+//                 none is given
+//   report        progress every this many trials (10000)
+//   seed          random seed (random)
+//   publish       POSIX shared memory segment in which to publish each
+//                 new best solution, as optimize --publish (none)
+// and the daemon answers with the lines
+//   queued ID
+//   started ID
+//   progress ID EVALUATIONS BESTCOST
+//   result ID REASON COST EVALUATIONS SECONDS PARAM...
+//   error MESSAGE
+// closing the connection after result or error. The job line must be
+// shorter than 1024 bytes and arrive within the receive timeout, or the
+// answer is "error line too long" or "error timeout". A client that closes its
+// connection cancels its job at the next progress report. Jobs are seeded
+// around the greedy schedule and the nearest archived solutions, and their
+// results are archived, as in optimize.
+//
+// This work is placed in the public domain / CC0.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <vector>
+#include <map>
+#include "opti.hpp"
+#include "normproblem.hpp"
+
+struct Job {
+  long long id;
+  int priority;
+  uid_t client;       // User of the client process
+  int fd;             // Connection to the client
+  int layers;
+  double startX;
+  double endX;
+  double multiplier;
+  int samples;
+  bool seeded;        // Seed given by the client
+  uint64_t seed;
+  char publish[256];  // Shared memory segment name, empty for none
+  Opti::RunLimits limits;
+};
+
+static std::mutex queueMutex;
+static std::condition_variable queueChanged;
+static std::vector<Job *> queue;      // Waiting jobs in arrival order
+static std::map<uid_t, int> running;  // Running jobs per client user
+static int quota;
+static bool useArchive = true;
+static const int MAX_SAMPLES = 1048577;  // Bounds the memory of one job
+static int receiveTimeout = 10;       // Seconds to wait for a job line
+static long long nextId = 1;
+
+// Write a line to fd. Returns false if the client is gone.
+static bool sendLine(int fd, const char *format, ...) {
+  char line[8192];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line)-1, format, args);
+  va_end(args);
+  if (length < 0) {
+    return false;
+  }
+  if (length > (int)sizeof(line)-2) {
+    length = sizeof(line)-2;
+  }
+  line[length++] = '\n';
+  for (int sent = 0; sent < length;) {
+    ssize_t n = send(fd, line+sent, length-sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Parse a job line into job. Returns NULL or an error message.
+static const char *parseJob(char *line, Job *job) {
+  job->priority = 0;
+  job->layers = 5;
+  job->startX = 0.001;
+  job->endX = 1.0;
+  job->multiplier = 1.01;
+  job->samples = 65537;
+  job->seeded = false;
+  job->seed = 0;
+  job->publish[0] = 0;
+  job->limits.reportInterval = 10000;
+  char *save;
+  char *token = strtok_r(line, " \t\r\n", &save);
+  if (!token || strcmp(token, "job")) {
+    return "expected job";
+  }
+  while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+    char *value = strchr(token, '=');
+    if (!value) {
+      return "expected key=value";
+    }
+    *value++ = 0;
+    if (!strcmp(token, "priority")) {
+      job->priority = atoi(value);
+    } else if (!strcmp(token, "layers")) {
+      job->layers = atoi(value);
+    } else if (!strcmp(token, "start")) {
+      job->startX = atof(value);
+    } else if (!strcmp(token, "end")) {
+      job->endX = atof(value);
+    } else if (!strcmp(token, "multiplier")) {
+      job->multiplier = atof(value);
+    } else if (!strcmp(token, "samples")) {
+      job->samples = atoi(value);
+    } else if (!strcmp(token, "evaluations")) {
+      job->limits.maxEvaluations = atoll(value);
+    } else if (!strcmp(token, "seconds")) {
+      job->limits.maxSeconds = atof(value);
+    } else if (!strcmp(token, "target")) {
+      job->limits.targetCost = atof(value);
+    } else if (!strcmp(token, "stagnation")) {
+      job->limits.stagnationWindow = atoll(value);
+    } else if (!strcmp(token, "report")) {
+      job->limits.reportInterval = atoll(value);
+    } else if (!strcmp(token, "seed")) {
+      job->seed = strtoull(value, NULL, 10);
+      job->seeded = true;
+    } else if (!strcmp(token, "publish")) {
+      snprintf(job->publish, sizeof(job->publish), "%s", value);
+    } else {
+      return "unknown key";
+    }
+  }
+  if (job->layers < 1 || job->layers > 64) {
+    return "layers must be 1..64";
+  }
+  if (job->samples < 16 || job->samples > MAX_SAMPLES) {
+    return "samples must be 16..1048577";
+  }
+  if (!(job->startX > 0 && job->startX < job->endX)) {
+    return "need 0 < start < end";
+  }
+  if (!job->limits.maxEvaluations && !job->limits.maxSeconds && !job->limits.stagnationWindow && job->limits.targetCost == -DBL_MAX) {
+    job->limits.stagnationWindow = 100000;
+  }
+  return NULL;
+}
+
+// Progress callback of Strategy::run. Stops the job if the client is gone.
+static bool reportProgress(void *context, long long evaluations, double bestcost) {
+  Job *job = (Job *)context;
+  return sendLine(job->fd, "progress %lld %lld %.20f", job->id, evaluations, bestcost);
+}
+
+// Improvement callback of Strategy::run
+static void publishBest(void *context, double const *best, double cost, long long evaluations) {
+  ((Opti::Publication *)context)->publish(best, cost, evaluations);
+}
+
+static void runJob(Job *job) {
+  static const char *reasons[] = {"evaluations", "time", "target", "stagnation", "cancel"};
+  int numParams = 3*job->layers;
+  NormProblem problem(numParams, job->samples, job->startX, job->endX, job->multiplier);
+  Opti::DERecombinator deRecombinator(0.999, 0.76);
+  Opti::DE de(&problem, 1000, &deRecombinator, job->seed);
+  // Seed a tenth of the population around the greedy schedule and another
+  // tenth around each of the nearest archived configurations
+  double *greedy = new double[numParams];
+  problem.greedySchedule(greedy);
+  problem.setCandidate(greedy);
+  de.seedPopulation(problem.getMin(), problem.getMax(), 100);
+  delete[] greedy;
+  char archiveName[256];
+  problem.archiveName(archiveName, sizeof(archiveName));
+  Opti::Archive archive(useArchive ? archiveName : NULL, numParams, NormProblem::NUM_ARCHIVE_KEYS);
+  double key[NormProblem::NUM_ARCHIVE_KEYS];
+  problem.archiveKey(key);
+  int nearest[4];
+  int numNearest = archive.isOpen() ? archive.nearest(key, nearest, 4) : 0;
+  double *archived = new double[numParams];
+  for (int i = 0; i < numNearest; i++) {
+    archive.getEntry(nearest[i], NULL, archived);
+    problem.setCandidate(archived);
+    de.seedPopulation(problem.getMin(), problem.getMax(), 100, 100*(i+1));
+  }
+  delete[] archived;
+  if (!sendLine(job->fd, "started %lld", job->id)) {
+    return;
+  }
+  job->limits.progress = reportProgress;
+  job->limits.progressContext = job;
+  Opti::Publication publication(job->publish[0] ? job->publish : NULL, numParams, true);
+  if (publication.isOpen()) {
+    job->limits.improved = publishBest;
+    job->limits.improvedContext = &publication;
+  } else if (job->publish[0]) {
+    printf("Job %lld could not open shared memory %s\n", job->id, job->publish);
+  }
+  Opti::RunResult result = de.run(job->limits);
+  double cost = problem.costFunction(result.best, std::numeric_limits<double>::max());
+  printf("Job %lld stopped by %s limit with cost %.20f\n", job->id, reasons[result.reason], cost);
+  if (result.reason == Opti::STOP_CANCELLED) {
+    return;
+  }
+  if (archive.isOpen()) {
+    archive.store(key, result.best, cost, result.evaluations, result.seconds, job->seed);
+  }
+  char params[8192];
+  int length = 0;
+  for (int i = 0; i < numParams; i++) {
+    length += snprintf(params+length, sizeof(params)-length, " %.20f", result.best[i]);
+  }
+  sendLine(job->fd, "result %lld %s %.20f %lld %f%s", job->id, reasons[result.reason], cost, result.evaluations, result.seconds, params);
+}
+
+// The waiting job of the highest priority, earliest first, whose client is
+// under its quota, or queue.end()
+static std::vector<Job *>::iterator nextJob() {
+  std::vector<Job *>::iterator chosen = queue.end();
+  for (std::vector<Job *>::iterator job = queue.begin(); job != queue.end(); job++) {
+    if (running[(*job)->client] < quota && (chosen == queue.end() || (*job)->priority > (*chosen)->priority)) {
+      chosen = job;
+    }
+  }
+  return chosen;
+}
+
+static void work() {
+  for (;;) {
+    Job *job;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueChanged.wait(lock, [] { return nextJob() != queue.end(); });
+      std::vector<Job *>::iterator chosen = nextJob();
+      job = *chosen;
+      queue.erase(chosen);
+      running[job->client]++;
+    }
+    runJob(job);
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      running[job->client]--;
+    }
+    queueChanged.notify_all();
+    close(job->fd);
+    delete job;
+  }
+}
+
+// Read the job line of a new connection and queue the job. A client that
+// sends no complete line within the receive timeout is dropped, so idle
+// connections do not hold threads.
+static void handleClient(int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = receiveTimeout;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char line[1024];
+  int length = 0;
+  for (;;) {
+    ssize_t n = recv(fd, line+length, 1, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      sendLine(fd, "error timeout");
+      close(fd);
+      return;
+    }
+    if (n <= 0 || line[length] == '\n') {
+      break;
+    }
+    if (++length == (int)sizeof(line)-1) {
+      sendLine(fd, "error line too long");
+      close(fd);
+      return;
+    }
+  }
+  line[length] = 0;
+  Job *job = new Job;
+  job->fd = fd;
+  job->client = (uid_t)-1;
+  struct ucred credentials;
+  socklen_t size = sizeof(credentials);
+  if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size)) {
+    job->client = credentials.uid;
+  }
+  const char *error = parseJob(line, job);
+  if (error) {
+    sendLine(fd, "error %s", error);
+    close(fd);
+    delete job;
+    return;
+  }
+  {
+    // MTRand behind randomSeed is not thread-safe
+    std::lock_guard<std::mutex> lock(queueMutex);
+    job->id = nextId++;
+    if (!job->seeded) {
+      job->seed = Opti::randomSeed();
+    }
+  }
+  printf("Job %lld from user %d: %d layers, priority %d, seed %llu\n", job->id, (int)job->client, job->layers, job->priority, (unsigned long long)job->seed);
+  if (!sendLine(fd, "queued %lld", job->id)) {
+    close(fd);
+    delete job;
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue.push_back(job);
+  }
+  queueChanged.notify_all();
+}
+
+// Options:
+//   --socket PATH   socket to listen on, default normd.sock
+//   --workers N     worker threads, default one per hardware thread
+//   --quota N       running jobs per client user, default all workers
+//   --no-archive    do not seed from or store to the archive
+//   --timeout S     seconds to wait for the job line of a connection,
+//                   at least 1, default 10
+int main(int argc, char **argv) {
+  const char *socketPath = "normd.sock";
+  int numWorkers = std::thread::hardware_concurrency();
+  quota = 0;
+  for (int i = 1; i < argc; i++) {
+    if (i+1 < argc && !strcmp(argv[i], "--socket")) {
+      socketPath = argv[++i];
+    } else if (i+1 < argc && !strcmp(argv[i], "--workers")) {
+      numWorkers = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--quota")) {
+      quota = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--no-archive")) {
+      useArchive = false;
+    } else if (i+1 < argc && !strcmp(argv[i], "--timeout")) {
+      receiveTimeout = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (receiveTimeout < 1) {
+    // Each waiting connection holds a thread, so it must not wait forever
+    fprintf(stderr, "--timeout must be at least 1\n");
+    return 1;
+  }
+  if (numWorkers < 1) {
+    numWorkers = 1;
+  }
+  if (quota < 1) {
+    quota = numWorkers;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (listener < 0 || strlen(socketPath) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Could not create socket %s\n", socketPath);
+    return 1;
+  }
+  strcpy(address.sun_path, socketPath);
+  unlink(socketPath);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, 64)) {
+    fprintf(stderr, "Could not listen on %s\n", socketPath);
+    return 1;
+  }
+  // Log lines are written from several threads, each at once
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("Listening on %s with %d workers, quota %d\n", socketPath, numWorkers, quota);
+  for (int i = 0; i < numWorkers; i++) {
+    std::thread(work).detach();
+  }
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("accept");
+      return 1;
+    }
+    std::thread(handleClient, fd).detach();
+  }
+}
+
+// Compile with:
+// g++ normd.cpp opti.cpp -ffast-math -march=native -O3 -Wno-unused-result -pthread -o normd
@@ -0,0 +1,961 @@
+#ifndef NORMPROBLEM_HPP
+#define NORMPROBLEM_HPP
+
+// The optimization problem of Newton-Schulz polynomial coefficients, and
+// the singular value spectra that can drive its sample set. Shared by the
+// optimize program and the normd daemon.
+//
+// This work is placed in the public domain / CC0.
+
+#include <stdio.h>
+#include <math.h>
+#include "opti.hpp"
+#include <limits>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class NormProblem final : public Opti::Problem {
+private:
+  int numParams;
+  int numSamples;
+  double *min;
+  double *max;
+  double *x;
+  double *w;               // Weight of the error at each sample
+  bool weighted;           // Samples set by setSamples
+  enum { NUM_PROBES = 8 };
+  int probes[NUM_PROBES];  // Sample indices checked before a full sweep
+  double *y;
+  double startX;
+  double endX;
+  double error_multiplier;
+  Opti::ThreadPool *pool;  // Splits the sweep of costFunction, or NULL
+  int minChunkSamples;
+  int numScenarios;        // Error scenarios of the robust cost, or 0
+  double *laneMultiplier;  // Scenario of each lane, unused lanes copying
+  double *laneNoise;       // the first scenario
+  double *laneScale;       // laneScale[j*MAX_SCENARIOS+lane] for layer j
+
+public:
+
+  // numParams must be odd
+  NormProblem(int numParams, int numSamples, double startX = 0.001, double endX = 1.0, double error_multiplier = 1.01, double* candidate = NULL) : numParams(numParams), numSamples(numSamples), startX(startX), endX(endX), error_multiplier(error_multiplier) {
+    min = new double[numParams];
+    max = new double[numParams];
+    x = new double[numSamples];
+    w = new double[numSamples];
+    weighted = false;
+    pool = NULL;
+    minChunkSamples = 0;
+    numScenarios = 0;
+    laneMultiplier = NULL;
+    laneNoise = NULL;
+    laneScale = NULL;
+    setCandidate(candidate);
+    placeSamples();
+  }
+
+  // Place the default samples over [startX, endX]
+  void placeSamples() {
+    for (int i = 0; i < numSamples; i++) {
+      // x[i] = startX + (endX-startX)*i/(numSamples-1);  // Uniform sampling
+      x[i] = startX + (endX-startX)*(0.5 - 0.5*cos(M_PI*i/(numSamples-1)));  // Like Chebyshev nodes but including end points, to make MSE-optimimal similar to maxabs-error-optimal
+      w[i] = 1.0;
+    }
+    chooseProbes();
+  }
+
+  // Change the interval and the error multiplier, moving the default
+  // samples to the new interval. For continuation from an easier problem;
+  // not for weighted samples or error scenarios, which are not moved.
+  void setParameters(double startX, double endX, double error_multiplier) {
+    this->startX = startX;
+    this->endX = endX;
+    this->error_multiplier = error_multiplier;
+    placeSamples();
+  }
+
+  // Replace the samples with numSamples ascending sample values newX[]
+  // spanning [startX, endX] and their error weights newW[] in (0, 1]. The cost is the
+  // max over samples of the weighted abs error, so a sample with weight w
+  // has error target cost/w.
+  void setSamples(int numSamples, double const *newX, double const *newW) {
+    delete[] x;
+    delete[] w;
+    this->numSamples = numSamples;
+    x = new double[numSamples];
+    w = new double[numSamples];
+    memcpy(x, newX, numSamples*sizeof(double));
+    memcpy(w, newW, numSamples*sizeof(double));
+    weighted = true;
+    chooseProbes();
+  }
+
+  bool isWeighted() {
+    return weighted;
+  }
+
+  enum { MAX_SCENARIOS = 8 };
+
+  // Replace the single error model of error_multiplier by the worst case of
+  // num <= MAX_SCENARIOS error scenarios. In scenario s, the output of each
+  // layer j is scaled by scales[s*numLayers+j] (1 if scales is NULL), then
+  // its upper track is multiplied by multipliers[s], and noises[s] is added
+  // to the upper track and subtracted from the lower one. The scenario
+  // (error_multiplier, 0, 1) is the default model. All scenarios are
+  // propagated together in the lanes of one sweep. num = 0 restores the
+  // default model.
+  void setScenarios(int num, double const *multipliers, double const *noises, double const *scales) {
+    delete[] laneMultiplier;
+    delete[] laneNoise;
+    delete[] laneScale;
+    numScenarios = std::min(num, (int)MAX_SCENARIOS);
+    laneMultiplier = laneNoise = laneScale = NULL;
+    if (numScenarios <= 0) {
+      numScenarios = 0;
+      return;
+    }
+    int numLayers = numParams/3;
+    laneMultiplier = new double[MAX_SCENARIOS];
+    laneNoise = new double[MAX_SCENARIOS];
+    laneScale = new double[numLayers*MAX_SCENARIOS];
+    for (int lane = 0; lane < MAX_SCENARIOS; lane++) {
+      int s = lane < numScenarios ? lane : 0;
+      laneMultiplier[lane] = multipliers[s];
+      laneNoise[lane] = noises[s];
+      for (int j = 0; j < numLayers; j++) {
+        laneScale[j*MAX_SCENARIOS+lane] = scales ? scales[s*numLayers+j] : 1.0;
+      }
+    }
+  }
+
+  // Costs of several error scenarios are not comparable to the default
+  bool isRobust() {
+    return numScenarios > 0;
+  }
+
+  // Choose the end points and samples near startX as probes, where the
+  // composite must grow the most and diverging candidates are typically
+  // worst
+  void chooseProbes() {
+    int probeIndices[NUM_PROBES] = {0, numSamples-1, 1, 2, 4, numSamples/64, numSamples/8, numSamples/2};
+    for (int p = 0; p < NUM_PROBES; p++) {
+      probes[p] = std::min(probeIndices[p], numSamples-1);
+    }
+  }
+
+  // Set the parameter ranges to candidate +/- fabs(candidate)*spread, or to
+  // [-0.5, 0.5] if candidate is NULL. The ranges are used in population
+  // initialization.
+  void setCandidate(double *candidate, double spread = 1.0/65536) {
+    if (candidate != NULL) {
+      for (int i = 0; i < numParams; i++) {
+        min[i] = candidate[i]-fabs(candidate[i])*spread;
+        max[i] = candidate[i]+fabs(candidate[i])*spread;
+      }
+    } else {
+      for (int i = 0; i < numParams; i++) {
+        min[i] = -0.5;
+        max[i] = 0.5;
+      }
+    }
+  }
+
+  // Minimax fit of a single odd polynomial p(y) = a y + b y^3 + c y^5 to
+  // the constant target over [l, u], 0 < l < u, by discrete Remez exchange
+  // on a Chebyshev-like grid. Stores a, b, c in coeffs and the range
+  // [minP, maxP] of p over the grid. Returns the max absolute error.
+  static double minimaxLayer(double target, double l, double u, double *coeffs, double &minP, double &maxP) {
+    const int numGrid = 4096;
+    const int maxIterations = 50;
+    const int numRef = 4; // 3 coefficients + level error
+    double grid[numGrid];
+    for (int i = 0; i < numGrid; i++) {
+      grid[i] = l + (u-l)*(0.5 - 0.5*cos(M_PI*i/(numGrid-1)));
+    }
+    // Reference points, initially Chebyshev extrema
+    double ref[numRef];
+    for (int k = 0; k < numRef; k++) {
+      ref[k] = l + (u-l)*(0.5 - 0.5*cos(M_PI*k/(numRef-1)));
+    }
+    double best[3] = {0, 0, 0};
+    double bestErr = std::numeric_limits<double>::max();
+    for (int iteration = 0; iteration < maxIterations; iteration++) {
+      // Solve p(ref[k]) + (-1)^k E = target by Gauss-Jordan elimination
+      double m[numRef][numRef+1];
+      for (int k = 0; k < numRef; k++) {
+        double y2 = ref[k]*ref[k];
+        m[k][0] = ref[k];
+        m[k][1] = ref[k]*y2;
+        m[k][2] = ref[k]*y2*y2;
+        m[k][3] = (k & 1)? -1.0 : 1.0;
+        m[k][4] = target;
+      }
+      bool singular = false;
+      for (int col = 0; col < numRef; col++) {
+        int pivot = col;
+        for (int row = col+1; row < numRef; row++) {
+          if (fabs(m[row][col]) > fabs(m[pivot][col])) {
+            pivot = row;
+          }
+        }
+        for (int k = 0; k <= numRef; k++) {
+          std::swap(m[col][k], m[pivot][k]);
+        }
+        if (m[col][col] == 0) {
+          singular = true;
+          break;
+        }
+        for (int row = 0; row < numRef; row++) {
+          if (row != col) {
+            double f = m[row][col]/m[col][col];
+            for (int k = col; k <= numRef; k++) {
+              m[row][k] -= f*m[col][k];
+            }
+          }
+        }
+      }
+      if (singular) {
+        break;
+      }
+      double p[3];
+      for (int k = 0; k < 3; k++) {
+        p[k] = m[k][numRef]/m[k][k];
+      }
+      double levelErr = fabs(m[3][numRef]/m[3][3]);
+      // Find alternating extrema of the error on the grid
+      double extremumY[numGrid];
+      double extremumErr[numGrid];
+      int numExtrema = 0;
+      double maxErr = 0;
+      for (int i = 0; i < numGrid; i++) {
+        double y = grid[i];
+        double y2 = y*y;
+        double err = y*(p[0] + y2*(p[1] + y2*p[2])) - target;
+        maxErr = std::max(maxErr, fabs(err));
+        if (numExtrema > 0 && (err < 0) == (extremumErr[numExtrema-1] < 0)) {
+          if (fabs(err) > fabs(extremumErr[numExtrema-1])) {
+            extremumY[numExtrema-1] = y;
+            extremumErr[numExtrema-1] = err;
+          }
+        } else {
+          extremumY[numExtrema] = y;
+          extremumErr[numExtrema] = err;
+          numExtrema++;
+        }
+      }
+      if (maxErr < bestErr) {
+        bestErr = maxErr;
+        for (int k = 0; k < 3; k++) {
+          best[k] = p[k];
+        }
+      }
+      if (numExtrema < numRef || maxErr - levelErr <= 1e-12*maxErr) {
+        break;
+      }
+      // Drop extrema from the ends, keeping the larger ones
+      int first = 0;
+      int last = numExtrema-1;
+      while (last-first+1 > numRef) {
+        if (fabs(extremumErr[first]) < fabs(extremumErr[last])) {
+          first++;
+        } else {
+          last--;
+        }
+      }
+      for (int k = 0; k < numRef; k++) {
+        ref[k] = extremumY[first+k];
+      }
+    }
+    minP = std::numeric_limits<double>::max();
+    maxP = -std::numeric_limits<double>::max();
+    for (int i = 0; i < numGrid; i++) {
+      double y = grid[i];
+      double y2 = y*y;
+      double p = y*(best[0] + y2*(best[1] + y2*best[2]));
+      minP = std::min(minP, p);
+      maxP = std::max(maxP, p);
+    }
+    for (int k = 0; k < 3; k++) {
+      coeffs[k] = best[k];
+    }
+    return bestErr;
+  }
+
+  // Compute a greedy schedule into params, as in Polar Express: each layer
+  // is the minimax fit to a constant over the image interval [l, u] of the
+  // previous layers, the upper end of which grows by error_multiplier per
+  // layer. The constant is chosen so that the next interval is centered at
+  // 1 in the max abs error sense. Finally the layers are rescaled to share
+  // the linear coefficient, which leaves the composite unchanged. Cheap
+  // compared to an optimization run and a good seed for one. Returns the
+  // cost of the schedule.
+  double greedySchedule(double *params) {
+    int numLayers = numParams/3;
+    double l = startX;
+    double u = endX;
+    for (int j = 0; j < numLayers; j++) {
+      double minP = l, maxP = u;
+      double delta = 0;
+      for (int refine = 0; refine < 3; refine++) {
+        double target = (2.0 - delta*(error_multiplier - 1.0))/(1.0 + error_multiplier);
+        delta = minimaxLayer(target, l, u, &params[j*3], minP, maxP);
+      }
+      l = minP;
+      u = maxP*error_multiplier;
+    }
+    // Layer j becomes s_j p_j(y/s_{j-1}), with s_0 = s_numLayers = 1
+    double logA = 0;
+    for (int j = 0; j < numLayers; j++) {
+      logA += log(fabs(params[j*3]));
+    }
+    double a = exp(logA/numLayers);
+    double prevScale = 1.0;
+    for (int j = 0; j < numLayers; j++) {
+      double scale = (j == numLayers-1)? 1.0 : prevScale*a/params[j*3];
+      double inv = 1.0/prevScale;
+      params[j*3] = a;
+      params[j*3+1] *= scale*inv*inv*inv;
+      params[j*3+2] *= scale*inv*inv*inv*inv*inv;
+      prevScale = scale;
+    }
+    return costFunction(params, std::numeric_limits<double>::max());
+  }
+
+  double *getMin() {
+    return min;
+  }
+
+  double *getMax() {
+    return max;
+  }
+
+  void print(double *params) {
+    printf("Printout:\n");
+    for (int i = 0; i < numParams; i += 3) {
+      printf("(");
+      for (int j = 0; j < 3; j++) {
+        printf("%.20f", params[i+j]);
+        if (j < 2) {
+          printf(", ");
+        }
+      }
+      printf("),\n");
+    }
+    printf("\n");
+    for (int i = 0; i < numParams; i += 3) {
+      for (int j = 0; j < 3; j++) {
+        printf(j < 2? "%.20f x^%d + " : "%.20f x^%d", params[i+j], j*2+1);
+      }
+      printf("\n");
+    }
+    printf("\n");
+  }
+
+  // Write an identifier naming this configuration, such as
+  // norm_5x5_x0_001_1_e1_01, to name (of size size).
+  void configName(char *name, size_t size) {
+    snprintf(name, size, "norm_%dx%d_x%g_%g_e%g", numParams/3, 5, startX, endX, error_multiplier);
+    for (char *c = name; *c; c++) {
+      if (*c == '.' || *c == '-' || *c == '+') {
+        *c = '_';
+      }
+    }
+  }
+
+  // Number of components in the archive key of a configuration
+  enum { NUM_ARCHIVE_KEYS = 4 };
+
+  // Write the key of this configuration in an Opti::Archive. The components
+  // are logarithms of the settings, so that nearby configurations have
+  // nearby keys regardless of scale.
+  void archiveKey(double *key) {
+    key[0] = log(startX);
+    key[1] = log(endX);
+    key[2] = log(error_multiplier);
+    key[3] = log((double)numSamples);
+  }
+
+  // Write the default archive file name for this layer count and degree,
+  // such as norm_5x5.archive, to name (of size size). The other settings
+  // are in the keys of the entries.
+  void archiveName(char *name, size_t size) {
+    snprintf(name, size, "norm_%dx%d.archive", numParams/3, 5);
+  }
+
+  // Write a C++ header for the coefficients in params. The header defines
+  // namespace name with constexpr coefficient tables and a Newton-Schulz
+  // iteration X <- (a I + A (b I + c A)) X, A = X X^T, in which each step is
+  // Horner's rule in A and the layer count and degree are compile-time
+  // constants. Headers for different configurations can be included together.
+  void exportCode(FILE *f, const char *name, double *params) {
+    double cost = costFunction(params, std::numeric_limits<double>::max());
+    int numLayers = numParams/3;
+    fprintf(f, "// Generated by optimize.cpp, do not edit.\n");
+    fprintf(f, "// %d layers of degree 5, x = [%.17g, %.17g], error multiplier %.17g,\n", numLayers, startX, endX, error_multiplier);
+    fprintf(f, "// %d samples, cost %.20f\n\n", numSamples, cost);
+    fprintf(f, "#ifndef %s_HPP\n#define %s_HPP\n\n", name, name);
+    fprintf(f, "namespace %s {\n\n", name);
+    fprintf(f, "  constexpr int numLayers = %d;\n", numLayers);
+    fprintf(f, "  constexpr int degree = 5;\n");
+    fprintf(f, "  constexpr int numTerms = (degree + 1)/2;\n");
+    fprintf(f, "  constexpr double startX = %.20g;\n", startX);
+    fprintf(f, "  constexpr double endX = %.20g;\n", endX);
+    fprintf(f, "  constexpr double errorMultiplier = %.20g;\n", error_multiplier);
+    fprintf(f, "  constexpr double cost = %.20g;\n\n", cost);
+    fprintf(f, "  // coeffs[j][k] is the coefficient of x^(2k+1) in the polynomial of layer j\n");
+    fprintf(f, "  constexpr double coeffs[numLayers][numTerms] = {\n");
+    for (int j = 0; j < numLayers; j++) {
+      fprintf(f, "    {%.20f, %.20f, %.20f},\n", params[j*3], params[j*3+1], params[j*3+2]);
+    }
+    fprintf(f, "  };\n\n");
+    fprintf(f, "  // Composite of all layers at a scalar (singular value) x\n");
+    fprintf(f, "  inline double composite(double x) {\n");
+    fprintf(f, "    for (int j = 0; j < numLayers; j++) {\n");
+    fprintf(f, "      double x2 = x*x;\n");
+    fprintf(f, "      double p = coeffs[j][numTerms-1];\n");
+    fprintf(f, "      for (int k = numTerms-2; k >= 0; k--) {\n");
+    fprintf(f, "        p = coeffs[j][k] + x2*p;\n");
+    fprintf(f, "      }\n");
+    fprintf(f, "      x *= p;\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "    return x;\n");
+    fprintf(f, "  }\n\n");
+    fprintf(f, "  // Size of the scratch buffer needed by step() and iterate()\n");
+    fprintf(f, "  template <int Rows, int Cols>\n");
+    fprintf(f, "  constexpr int workSize() {\n");
+    fprintf(f, "    return 3*Rows*Rows + Rows*Cols;\n");
+    fprintf(f, "  }\n\n");
+    fprintf(f, "  // One step X <- p(X X^T) X for the row-major Rows x Cols matrix X,\n");
+    fprintf(f, "  // Rows <= Cols, with p evaluated by Horner's rule in A = X X^T.\n");
+    fprintf(f, "  template <int Rows, int Cols, typename T>\n");
+    fprintf(f, "  inline void step(T *X, T *work, double const (&c)[numTerms]) {\n");
+    fprintf(f, "    T *A = work;\n");
+    fprintf(f, "    T *B = A + Rows*Rows;\n");
+    fprintf(f, "    T *C = B + Rows*Rows;\n");
+    fprintf(f, "    T *Y = C + Rows*Rows;\n");
+    fprintf(f, "    for (int i = 0; i < Rows; i++) {\n");
+    fprintf(f, "      for (int j = 0; j <= i; j++) {\n");
+    fprintf(f, "        T s = 0;\n");
+    fprintf(f, "        for (int k = 0; k < Cols; k++) {\n");
+    fprintf(f, "          s += X[i*Cols+k]*X[j*Cols+k];\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "        A[i*Rows+j] = s;\n");
+    fprintf(f, "        A[j*Rows+i] = s;\n");
+    fprintf(f, "      }\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "    for (int i = 0; i < Rows*Rows; i++) {\n");
+    fprintf(f, "      B[i] = T(c[numTerms-1])*A[i];\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "    for (int k = numTerms-2; k >= 0; k--) {\n");
+    fprintf(f, "      for (int i = 0; i < Rows; i++) {\n");
+    fprintf(f, "        B[i*Rows+i] += T(c[k]);\n");
+    fprintf(f, "      }\n");
+    fprintf(f, "      if (k == 0) {\n");
+    fprintf(f, "        break;\n");
+    fprintf(f, "      }\n");
+    fprintf(f, "      for (int i = 0; i < Rows; i++) {\n");
+    fprintf(f, "        for (int j = 0; j < Rows; j++) {\n");
+    fprintf(f, "          T s = 0;\n");
+    fprintf(f, "          for (int k2 = 0; k2 < Rows; k2++) {\n");
+    fprintf(f, "            s += A[i*Rows+k2]*B[k2*Rows+j];\n");
+    fprintf(f, "          }\n");
+    fprintf(f, "          C[i*Rows+j] = s;\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "      }\n");
+    fprintf(f, "      T *temp = B;\n");
+    fprintf(f, "      B = C;\n");
+    fprintf(f, "      C = temp;\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "    for (int i = 0; i < Rows; i++) {\n");
+    fprintf(f, "      for (int j = 0; j < Cols; j++) {\n");
+    fprintf(f, "        T s = 0;\n");
+    fprintf(f, "        for (int k = 0; k < Rows; k++) {\n");
+    fprintf(f, "          s += B[i*Rows+k]*X[k*Cols+j];\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "        Y[i*Cols+j] = s;\n");
+    fprintf(f, "      }\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "    for (int i = 0; i < Rows*Cols; i++) {\n");
+    fprintf(f, "      X[i] = Y[i];\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "  }\n\n");
+    fprintf(f, "  // All numLayers steps. X should be prescaled to have singular values\n");
+    fprintf(f, "  // in [startX, endX]. work must hold workSize<Rows, Cols>() elements.\n");
+    fprintf(f, "  template <int Rows, int Cols, typename T>\n");
+    fprintf(f, "  inline void iterate(T *X, T *work) {\n");
+    fprintf(f, "    for (int j = 0; j < numLayers; j++) {\n");
+    fprintf(f, "      step<Rows, Cols>(X, work, coeffs[j]);\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "  }\n\n");
+    fprintf(f, "} // end namespace %s\n\n", name);
+    fprintf(f, "#endif\n");
+  }
+
+  // Export the coefficients in params to a header named after the
+  // configuration. Returns false if the file could not be written.
+  bool exportHeader(double *params) {
+    char name[256];
+    char filename[300];
+    configName(name, sizeof(name));
+    snprintf(filename, sizeof(filename), "%s.hpp", name);
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+      return false;
+    }
+    exportCode(f, name, params);
+    fclose(f);
+    printf("Exported %s\n", filename);
+    return true;
+  }
+
+  // Describe the constraints enforced by costFunction: the linear
+  // coefficients are tied to the first one, which is positive. Searching
+  // through a ReducedProblem with this map leaves 2*layers+1 dimensions.
+  void defineParameterMap(Opti::ParameterMap &map) {
+    map.constrainSign(0, 1);
+    for (int j = 1; j*3 < numParams; j++) {
+      map.tie(j*3, 0);
+    }
+  }
+
+  // Make the linear coefficients equal and positive
+  void constrain(double *params) {
+    params[0] = fabs(params[0]);
+    for (int j = 0; j*3 < numParams; j++) {
+      params[j*3] = params[0];
+    }
+  }
+
+  // Abs error of both tracks at sample value x0, or the largest double if
+  // either track overflowed or became nan. Nan fails every comparison and
+  // -ffast-math removes x == x checks, so the bits of the sum of the tracks
+  // are tested instead; inf and nan in either track carry over to the sum.
+  double sampleError(double const *params, double x0) {
+    if (numScenarios) {
+      return robustError(params, x0);
+    }
+    double y = x0;
+    double y_plus_error = x0;
+    for (int j = 0; j < numParams/3; j++) {
+      y = params[j*3]*y + params[j*3+1]*(y*(y*y)) + params[j*3+2]*(y*(y*y)*(y*y));
+      y_plus_error = params[j*3]*y_plus_error + params[j*3+1]*(y_plus_error*(y_plus_error*y_plus_error)) + params[j*3+2]*(y_plus_error*(y_plus_error*y_plus_error)*(y_plus_error*y_plus_error));
+      if (y_plus_error < y) {
+        std::swap(y, y_plus_error);
+      }
+      y_plus_error *= error_multiplier;
+    }
+    if (!Opti::isFinite(y + y_plus_error)) {
+      return std::numeric_limits<double>::max();
+    }
+    return std::max(fabs(y_plus_error - 1.0), fabs(y - 1.0));
+  }
+
+  // Worst abs error over the tracks of all scenarios at sample value x0, as
+  // sampleError. The loops over the lanes have no branches, so that they
+  // vectorize.
+  double robustError(double const *params, double x0) {
+    alignas(64) double lower[MAX_SCENARIOS];
+    alignas(64) double upper[MAX_SCENARIOS];
+    for (int lane = 0; lane < MAX_SCENARIOS; lane++) {
+      lower[lane] = upper[lane] = x0;
+    }
+    for (int j = 0; j < numParams/3; j++) {
+      double a = params[j*3], b = params[j*3+1], c = params[j*3+2];
+      double const *scale = &laneScale[j*MAX_SCENARIOS];
+      for (int lane = 0; lane < MAX_SCENARIOS; lane++) {
+        double y = lower[lane], yp = upper[lane];
+        y = scale[lane]*(a*y + b*(y*(y*y)) + c*(y*(y*y)*(y*y)));
+        yp = scale[lane]*(a*yp + b*(yp*(yp*yp)) + c*(yp*(yp*yp)*(yp*yp)));
+        lower[lane] = std::min(y, yp) - laneNoise[lane];
+        upper[lane] = std::max(y, yp)*laneMultiplier[lane] + laneNoise[lane];
+      }
+    }
+    double sum = 0, maxAbsErr = 0;
+    for (int lane = 0; lane < MAX_SCENARIOS; lane++) {
+      sum += lower[lane] + upper[lane];
+      maxAbsErr = std::max(maxAbsErr, std::max(fabs(upper[lane] - 1.0), fabs(lower[lane] - 1.0)));
+    }
+    if (!Opti::isFinite(sum)) {
+      return std::numeric_limits<double>::max();
+    }
+    return maxAbsErr;
+  }
+
+  // Max abs error over the probe samples, a lower bound of the cost found
+  // in a few operations. Stops early, returning a value > compare, once the
+  // error exceeds compare.
+  double probe(double const *params, double compare) {
+    double maxAbsErr = 0.0;
+    for (int p = 0; p < NUM_PROBES; p++) {
+      double absErr = sampleError(params, x[probes[p]])*w[probes[p]];
+      if (absErr > maxAbsErr) {
+        maxAbsErr = absErr;
+        if (maxAbsErr > compare) {
+          return maxAbsErr;
+        }
+      }
+    }
+    return maxAbsErr;
+  }
+
+  // Max abs error over samples begin..end-1 and maxAbsErr. Stops early,
+  // returning a value > compare, once the error exceeds compare.
+  double sweep(double const *params, int begin, int end, double maxAbsErr, double compare) {
+    for (int i = begin; i < end; i++) {
+      double absErr = sampleError(params, x[i])*w[i];
+      if (absErr > maxAbsErr) {
+        maxAbsErr = absErr;
+        if (maxAbsErr > compare) {
+          return maxAbsErr;
+        }
+      }
+    }
+    return maxAbsErr;
+  }
+
+  // Split the sweep of each costFunction call into chunks of at least
+  // minChunkSamples samples evaluated on pool, or sweep serially if pool is
+  // NULL. Worth it only for very many samples, when a single evaluation is
+  // long. Batches of costFunctionBatch are split over pool by candidates.
+  // The pool must not be running other work at the same time, so
+  // costFunction must not be called from its threads.
+  void setThreadPool(Opti::ThreadPool *pool, int minChunkSamples = 16384) {
+    this->pool = pool;
+    this->minChunkSamples = minChunkSamples;
+  }
+
+  // Max abs error over all samples and maxAbsErr, with the samples split
+  // into chunks on the thread pool. The chunks share a running maximum and
+  // check it between blocks of samples, so that all of them stop once it
+  // exceeds compare. Returns the same as a serial sweep.
+  double parallelSweep(double const *params, double maxAbsErr, double compare) {
+    const int blockSamples = 4096;
+    int numChunks = std::min(4*pool->getNumThreads(), numSamples/minChunkSamples);
+    std::atomic<double> running(maxAbsErr);
+    pool->parallelFor(numChunks, [&](int chunk) {
+      int begin = (int)((long long)numSamples*chunk/numChunks);
+      int end = (int)((long long)numSamples*(chunk+1)/numChunks);
+      double chunkMax = maxAbsErr;
+      for (int block = begin; block < end; block += blockSamples) {
+        double shared = running.load(std::memory_order_relaxed);
+        if (shared > compare) {
+          return;
+        }
+        chunkMax = sweep(params, block, std::min(block + blockSamples, end), std::max(chunkMax, shared), compare);
+        double current = running.load(std::memory_order_relaxed);
+        while (chunkMax > current && !running.compare_exchange_weak(current, chunkMax, std::memory_order_relaxed)) {
+        }
+      }
+    });
+    return running.load();
+  }
+
+  // The pieces are the weighted errors at the local maxima of the error
+  // over the samples. Their gradients are computed in forward mode, with a
+  // tangent of each track for every parameter carried through the layers
+  // and the loops over the active samples innermost, so that they
+  // vectorize. The linear coefficients are tied to params[0], so their
+  // gradient is collected to params[0].
+  int activePieces(double *params, double tolerance, double *values, double *gradients, int maxPieces) {
+    if (numScenarios) {
+      return 0;  // Only the default error model is differentiated
+    }
+    constrain(params);
+    double *errors = new double[numSamples];
+    double maxErr = 0;
+    for (int i = 0; i < numSamples; i++) {
+      errors[i] = sampleError(params, x[i])*w[i];
+      maxErr = std::max(maxErr, errors[i]);
+    }
+    if (maxErr >= std::numeric_limits<double>::max()) {
+      delete[] errors;
+      return 0;
+    }
+    // Local maxima within tolerance, largest first
+    int *active = new int[numSamples];
+    int numActive = 0;
+    for (int i = 0; i < numSamples; i++) {
+      if (errors[i] >= maxErr - tolerance && (i == 0 || errors[i] >= errors[i-1]) && (i == numSamples-1 || errors[i] > errors[i+1])) {
+        active[numActive++] = i;
+      }
+    }
+    std::sort(active, active+numActive, [&](int a, int b) { return errors[a] > errors[b]; });
+    int n = std::min(numActive, maxPieces);
+    // Tracks and their tangents, tangent[p*n+s] for parameter p and sample s
+    double *y = new double[4*n];
+    double *yp = y+n;
+    double *dy = y+2*n;
+    double *dyp = y+3*n;
+    double *t = new double[2*numParams*n]();
+    double *tp = t+numParams*n;
+    for (int s = 0; s < n; s++) {
+      y[s] = yp[s] = x[active[s]];
+    }
+    for (int j = 0; j < numParams/3; j++) {
+      double a = params[j*3], b = params[j*3+1], c = params[j*3+2];
+      for (int s = 0; s < n; s++) {
+        dy[s] = a + y[s]*y[s]*(3*b + 5*c*y[s]*y[s]);
+        dyp[s] = a + yp[s]*yp[s]*(3*b + 5*c*yp[s]*yp[s]);
+      }
+      for (int p = 0; p < 3*j; p++) {
+        for (int s = 0; s < n; s++) {
+          t[p*n+s] *= dy[s];
+          tp[p*n+s] *= dyp[s];
+        }
+      }
+      for (int s = 0; s < n; s++) {
+        double y2 = y[s]*y[s], yp2 = yp[s]*yp[s];
+        t[(j*3)*n+s] = y[s];
+        t[(j*3+1)*n+s] = y[s]*y2;
+        t[(j*3+2)*n+s] = y[s]*y2*y2;
+        tp[(j*3)*n+s] = yp[s];
+        tp[(j*3+1)*n+s] = yp[s]*yp2;
+        tp[(j*3+2)*n+s] = yp[s]*yp2*yp2;
+        y[s] = y[s]*(a + y2*(b + c*y2));
+        yp[s] = yp[s]*(a + yp2*(b + c*yp2));
+      }
+      // Keep the tracks ordered as in sampleError
+      for (int s = 0; s < n; s++) {
+        if (yp[s] < y[s]) {
+          std::swap(y[s], yp[s]);
+          for (int p = 0; p < 3*(j+1); p++) {
+            std::swap(t[p*n+s], tp[p*n+s]);
+          }
+        }
+        yp[s] *= error_multiplier;
+      }
+      for (int p = 0; p < 3*(j+1); p++) {
+        for (int s = 0; s < n; s++) {
+          tp[p*n+s] *= error_multiplier;
+        }
+      }
+    }
+    for (int s = 0; s < n; s++) {
+      // The larger of the two track errors is the piece
+      bool upper = fabs(yp[s] - 1.0) >= fabs(y[s] - 1.0);
+      double track = upper ? yp[s] : y[s];
+      double const *tangent = upper ? tp : t;
+      double sign = track >= 1.0 ? w[active[s]] : -w[active[s]];
+      values[s] = fabs(track - 1.0)*w[active[s]];
+      double *gradient = &gradients[s*numParams];
+      for (int p = 0; p < numParams; p++) {
+        gradient[p] = sign*tangent[p*n+s];
+      }
+      for (int j = 1; j*3 < numParams; j++) {
+        gradient[0] += gradient[j*3];
+        gradient[j*3] = 0;
+      }
+    }
+    delete[] errors;
+    delete[] active;
+    delete[] y;
+    delete[] t;
+    return n;
+  }
+
+  // Candidates that fail the probe samples are rejected without a sweep
+  double costFunction(double *params, double compare) {
+    constrain(params);
+    double maxAbsErr = probe(params, compare);
+    if (maxAbsErr <= compare) {
+      if (pool && numSamples >= 2*minChunkSamples) {
+        maxAbsErr = parallelSweep(params, maxAbsErr, compare);
+      } else {
+        maxAbsErr = sweep(params, 0, numSamples, maxAbsErr, compare);
+      }
+    }
+    return maxAbsErr > compare ? compare : maxAbsErr;
+  }
+
+  // Evaluate the candidates in tiles of blockSamples samples x all
+  // candidates still running, so that each block of x[] and w[] is reused from L1
+  // cache by every candidate. A candidate drops out once its error
+  // exceeds its compare value, or at once if it fails the probe samples.
+  // With a thread pool, the candidates are split into groups tiled on the
+  // threads in parallel.
+  void costFunctionBatch(double **params, double const *compare, double *costs, int num) {
+    if (pool && num > 1) {
+      int numGroups = std::min(num, 4*pool->getNumThreads());
+      pool->parallelFor(numGroups, [&](int group) {
+        int begin = (int)((long long)num*group/numGroups);
+        int end = (int)((long long)num*(group+1)/numGroups);
+        batchSweep(params+begin, compare+begin, costs+begin, end-begin);
+      });
+    } else {
+      batchSweep(params, compare, costs, num);
+    }
+  }
+
+  // costFunctionBatch on the calling thread
+  void batchSweep(double **params, double const *compare, double *costs, int num) {
+    const int blockSamples = 1024; // 16 KB of x[] and w[]
+    int *running = new int[num];
+    int numRunning = 0;
+    for (int c = 0; c < num; c++) {
+      constrain(params[c]);
+      costs[c] = probe(params[c], compare[c]);
+      if (costs[c] > compare[c]) {
+        costs[c] = compare[c];
+      } else {
+        running[numRunning++] = c;
+      }
+    }
+    for (int begin = 0; begin < numSamples && numRunning > 0; begin += blockSamples) {
+      int end = std::min(begin + blockSamples, numSamples);
+      for (int r = 0; r < numRunning;) {
+        int c = running[r];
+        costs[c] = sweep(params[c], begin, end, costs[c], compare[c]);
+        if (costs[c] > compare[c]) {
+          costs[c] = compare[c];
+          running[r] = running[--numRunning];
+        } else {
+          r++;
+        }
+      }
+    }
+    delete[] running;
+  }
+
+  // Objectives of the Pareto mode: the max abs error, and the largest
+  // |a|+|b|+|c| over layers, which bounds how much a layer can amplify
+  // |y| <= 1 and thus the dynamic range needed in low precision
+  int getNumObjectives() {
+    return 2;
+  }
+
+  // Errors of 1 or more are useless, so the sweep stops there
+  void costVector(double *params, double *costs) {
+    costs[0] = costFunction(params, 1.0);
+    costs[1] = 0;
+    for (int j = 0; j*3 < numParams; j++) {
+      costs[1] = std::max(costs[1], fabs(params[j*3]) + fabs(params[j*3+1]) + fabs(params[j*3+2]));
+    }
+  }
+
+  int getNumDimensions() {
+    return numParams;
+  }
+
+  ~NormProblem() {
+    delete[] min;
+    delete[] max;
+    delete[] x;
+    delete[] w;
+    delete[] laneMultiplier;
+    delete[] laneNoise;
+    delete[] laneScale;
+  }
+};
+
+// Distribution of the singular values met in training, accumulated from
+// recorded histograms into logarithmically spaced bins over [startX, endX].
+// A histogram file is a flat array of native-endian double pairs (singular
+// value, count). Files are memory mapped, so large recordings are read
+// without copying. Values outside the interval count in the end bins.
+class Spectrum {
+private:
+  double startX;
+  double endX;
+  int numBins;
+  double *counts;
+  double total;
+
+  int bin(double value) {
+    int b = (int)floor(log(value/startX)/log(endX/startX)*numBins);
+    return b < 0 ? 0 : b >= numBins ? numBins-1 : b;
+  }
+
+  // Lower edge of bin b
+  double edge(int b) {
+    return startX*pow(endX/startX, (double)b/numBins);
+  }
+
+public:
+  Spectrum(double startX, double endX, int numBins = 256) : startX(startX), endX(endX), numBins(numBins), total(0) {
+    counts = new double[numBins]();
+  }
+
+  ~Spectrum() {
+    delete[] counts;
+  }
+
+  // Add the histogram in fileName. Returns false if it could not be read.
+  bool load(const char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) || status.st_size < (off_t)(2*sizeof(double))) {
+      close(fd);
+      return false;
+    }
+    void *mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+    madvise(mapped, status.st_size, MADV_SEQUENTIAL);
+    double const *pairs = (double const *)mapped;
+    size_t numPairs = status.st_size/(2*sizeof(double));
+    for (size_t i = 0; i < numPairs; i++) {
+      double value = pairs[2*i];
+      double count = pairs[2*i+1];
+      if (value > 0 && count > 0 && Opti::isFinite(value + count)) {
+        counts[bin(value)] += count;
+        total += count;
+      }
+    }
+    munmap(mapped, status.st_size);
+    return true;
+  }
+
+  double getTotal() {
+    return total;
+  }
+
+  // Place numSamples ascending samples in x[] at the quantiles of a mix of
+  // the spectrum (fraction 1-mix) and the Chebyshev-like density of the
+  // default grid (fraction mix), which keeps every part of the interval
+  // covered. Both end points are included. Each sample gets the weight
+  // floorWeight + (1-floorWeight)*(count of its bin)/(largest bin count),
+  // so that rare singular values are allowed errors up to 1/floorWeight
+  // times the cost.
+  void sampleSet(int numSamples, double *x, double *w, double mix = 0.25, double floorWeight = 0.25) {
+    double maxCount = 0;
+    double *cumulative = new double[numBins+1];
+    cumulative[0] = 0;
+    for (int b = 0; b < numBins; b++) {
+      maxCount = std::max(maxCount, counts[b]);
+      cumulative[b+1] = cumulative[b] + counts[b]/total;
+    }
+    for (int i = 0; i < numSamples; i++) {
+      double q = (double)i/(numSamples-1);
+      // Invert the mixed distribution function by bisection
+      double lo = startX, hi = endX;
+      for (int iteration = 0; iteration < 60; iteration++) {
+        double mid = 0.5*(lo + hi);
+        int b = bin(mid);
+        double inBin = log(mid/edge(b))/log(edge(b+1)/edge(b));
+        double spectrumF = cumulative[b] + (cumulative[b+1]-cumulative[b])*std::min(1.0, std::max(0.0, inBin));
+        double chebyshevF = acos(1.0 - 2.0*(mid-startX)/(endX-startX))/M_PI;
+        if ((1.0-mix)*spectrumF + mix*chebyshevF < q) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+      x[i] = i == 0 ? startX : i == numSamples-1 ? endX : 0.5*(lo + hi);
+      w[i] = floorWeight + (1.0-floorWeight)*counts[bin(x[i])]/maxCount;
+    }
+    delete[] cumulative;
+  }
+};
+
+#endif
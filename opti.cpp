@@ -8,15 +8,31 @@
 #include <algorithm>
 #include <float.h>
 #include <assert.h>
+#include <chrono>
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 namespace Opti {
 
   MTRand rng;
+
+  uint64_t randomSeed() {
+    uint64_t hi = rng.randInt();
+    return (hi << 32) | rng.randInt();
+  }
   
   // Perform Fisher-Yates shuffle 
-  void shuffle(int *table, int num) {
+  void shuffle(int *table, int num, Philox &rng) {
     for (int t = 0; (t < num); t++) {
-      int u = rng.randInt(num-t-1);
+      int u = rng.randBounded(num-t);
       int temp = table[t];
       table[t] = table[t+u];
       table[t+u] = temp;
@@ -25,14 +41,30 @@ namespace Opti {
   
   // Perform partial Fisher-Yates shuffle
   // Only first numshuffle entries in the table are shuffled properly with the rest of the table
-  void partialShuffle(int *table, int numtotal, int numshuffle) {
+  void partialShuffle(int *table, int numtotal, int numshuffle, Philox &rng) {
     for (int t = 0; (t < numshuffle); t++) {
-      int u = rng.randInt(numtotal-t-1);
+      int u = rng.randBounded(numtotal-t);
       int temp = table[t];
       table[t] = table[t+u];
       table[t+u] = temp;
     }
   }
+
+  void distinctRandom(int *table, int numtotal, int num, Philox &rng) {
+    assert(num <= numtotal);
+    for (int t = 0; (t < num); t++) {
+      int u;
+      bool taken;
+      do {
+	u = rng.randBounded(numtotal);
+	taken = false;
+	for (int v = 0; (v < t); v++) {
+	  if (table[v] == u) taken = true;
+	}
+      } while (taken);
+      table[t] = u;
+    }
+  }
   
   // Compute square of the perpendicular (that is, shortest) distance from 
   // a point (point) to a line in a multidimensional space. The line is 
@@ -50,7 +82,90 @@ namespace Opti {
       b+=linedirection[i]*d;
       v2+=linedirection[i]*linedirection[i];
     }
-    return s2-b*b/v2;
+    if (v2 == 0) return s2;
+    double squaredDistance = s2-b*b/v2;
+    // Rounding can make a near-zero distance negative
+    return squaredDistance > 0 ? squaredDistance : 0;
+  }
+
+  ThreadPool::ThreadPool(int numThreads)
+  {
+    if (numThreads <= 0) numThreads = std::thread::hardware_concurrency();
+    if (numThreads <= 0) numThreads = 1;
+    numWorkers = numThreads-1;
+    job = NULL;
+    jobSize = 0;
+    next = 0;
+    running = 0;
+    jobNumber = 0;
+    quit = false;
+    workers = new std::thread[numWorkers];
+    for (int i = 0; i < numWorkers; i++) {
+      workers[i] = std::thread(&ThreadPool::work, this);
+    }
+  }
+
+  ThreadPool::~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    started.notify_all();
+    for (int i = 0; i < numWorkers; i++) {
+      workers[i].join();
+    }
+    delete[] workers;
+  }
+
+  int ThreadPool::getNumThreads()
+  {
+    return numWorkers+1;
+  }
+
+  void ThreadPool::runJob()
+  {
+    for (int i; (i = next++) < jobSize;) {
+      (*job)(i);
+    }
+  }
+
+  void ThreadPool::work()
+  {
+    unsigned long seen = 0;
+    for (;;) {
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	started.wait(lock, [&] { return quit || jobNumber != seen; });
+	if (quit) return;
+	seen = jobNumber;
+      }
+      runJob();
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--running == 0) finished.notify_one();
+      }
+    }
+  }
+
+  void ThreadPool::parallelFor(int num, std::function<void(int)> const &function)
+  {
+    if (numWorkers == 0 || num <= 1) {
+      for (int i = 0; i < num; i++) function(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &function;
+      jobSize = num;
+      next = 0;
+      running = numWorkers;
+      jobNumber++;
+    }
+    started.notify_all();
+    runJob();
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return running == 0; });
   }
   
   // Randomize by system clock. Please call me!
@@ -81,19 +196,779 @@ namespace Opti {
     printf("\n");
   }
   
+  void Problem::costFunctionBatch(double **params, double const *compare, double *costs, int num)
+  {
+    for (int i = 0; i < num; i++) {
+      costs[i] = costFunction(params[i], compare[i]);
+    }
+  }
+
+  int Problem::getNumObjectives()
+  {
+    return 1;
+  }
+
+  void Problem::costVector(double *params, double *costs)
+  {
+    costs[0] = costFunction(params, DBL_MAX);
+  }
+
+  int Problem::activePieces(double *, double, double *, double *, int)
+  {
+    return 0;
+  }
+
   Problem::~Problem()
   {
   }
   
+  ParameterMap::ParameterMap(int numFull)
+  {
+    this->numFull = numFull;
+    source = new int[numFull];
+    sign = new int[numFull];
+    min = new double[numFull];
+    max = new double[numFull];
+    for (int i = 0; i < numFull; i++) {
+      source[i] = i;
+      sign[i] = 0;
+      min[i] = -DBL_MAX;
+      max[i] = DBL_MAX;
+    }
+  }
+
+  ParameterMap::~ParameterMap()
+  {
+    delete[] source;
+    delete[] sign;
+    delete[] min;
+    delete[] max;
+  }
+
+  void ParameterMap::tie(int param, int source)
+  {
+    assert(this->source[source] == source && param != source);
+    this->source[param] = source;
+  }
+
+  void ParameterMap::constrainSign(int param, int sign)
+  {
+    this->sign[param] = sign;
+  }
+
+  void ParameterMap::clamp(int param, double min, double max)
+  {
+    this->min[param] = min;
+    this->max[param] = max;
+  }
+
+  int ParameterMap::getNumFull()
+  {
+    return numFull;
+  }
+
+  int ParameterMap::getNumFree()
+  {
+    int numFree = 0;
+    for (int i = 0; i < numFull; i++) {
+      if (source[i] == i) numFree++;
+    }
+    return numFree;
+  }
+
+  void ParameterMap::expand(double *free, double *full)
+  {
+    int f = 0;
+    for (int i = 0; i < numFull; i++) {
+      if (source[i] == i) {
+	double value = free[f];
+	if (sign[i] > 0) value = fabs(value);
+	else if (sign[i] < 0) value = -fabs(value);
+	if (value < min[i]) value = min[i];
+	if (value > max[i]) value = max[i];
+	free[f++] = value;
+	full[i] = value;
+      }
+    }
+    for (int i = 0; i < numFull; i++) {
+      full[i] = full[source[i]];
+    }
+  }
+
+  void ParameterMap::reduce(double const *full, double *free)
+  {
+    int f = 0;
+    for (int i = 0; i < numFull; i++) {
+      if (source[i] == i) free[f++] = full[i];
+    }
+  }
+
+  ReducedProblem::ReducedProblem(Problem *problem, ParameterMap *map)
+  {
+    assert(map->getNumFull() == problem->getNumDimensions());
+    this->problem = problem;
+    this->map = map;
+    min = new double[map->getNumFree()];
+    max = new double[map->getNumFree()];
+  }
+
+  ReducedProblem::~ReducedProblem()
+  {
+    delete[] min;
+    delete[] max;
+  }
+
+  int ReducedProblem::getNumDimensions()
+  {
+    return map->getNumFree();
+  }
+
+  double *ReducedProblem::getMin()
+  {
+    map->reduce(problem->getMin(), min);
+    return min;
+  }
+
+  double *ReducedProblem::getMax()
+  {
+    map->reduce(problem->getMax(), max);
+    return max;
+  }
+
+  void ReducedProblem::expand(double *params, double *full)
+  {
+    map->expand(params, full);
+  }
+
+  double ReducedProblem::costFunction(double *params, double compare)
+  {
+    // Stack buffer for the full vector in the common case of few parameters
+    double buffer[64];
+    int numFull = map->getNumFull();
+    double *full = (numFull <= 64) ? buffer : new double[numFull];
+    map->expand(params, full);
+    double cost = problem->costFunction(full, compare);
+    if (full != buffer) delete[] full;
+    return cost;
+  }
+
+  void ReducedProblem::costFunctionBatch(double **params, double const *compare, double *costs, int num)
+  {
+    int numFull = map->getNumFull();
+    double *full = new double[num*numFull];
+    double **fullpointers = new double *[num];
+    for (int i = 0; i < num; i++) {
+      fullpointers[i] = &full[i*numFull];
+      map->expand(params[i], fullpointers[i]);
+    }
+    problem->costFunctionBatch(fullpointers, compare, costs, num);
+    delete[] full;
+    delete[] fullpointers;
+  }
+
+  void ReducedProblem::print(double *params)
+  {
+    double *full = new double[map->getNumFull()];
+    map->expand(params, full);
+    problem->print(full);
+    delete[] full;
+  }
+
+  RunLimits::RunLimits()
+  {
+    maxEvaluations = 0;
+    maxSeconds = 0;
+    targetCost = -DBL_MAX;
+    stagnationWindow = 0;
+    reportInterval = 0;
+    progress = NULL;
+    progressContext = NULL;
+    improved = NULL;
+    improvedContext = NULL;
+  }
+
+  Strategy::Strategy()
+  {
+    numEvaluations = 0;
+  }
+
   Strategy::~Strategy()
   {
   }
+
+  void Strategy::printStatistics()
+  {
+  }
+
+  long long Strategy::evaluations()
+  {
+    return numEvaluations;
+  }
+
+  RunResult Strategy::run(RunLimits const &limits)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long startEvaluations = numEvaluations;
+    long long lastImprovement = numEvaluations;
+    double bestcost = DBL_MAX;
+    RunResult result;
+    for (long long t = 0;; t++) {
+      double cost = evolve();
+      if (cost < bestcost) {
+	bestcost = cost;
+	lastImprovement = numEvaluations;
+	if (limits.improved) {
+	  limits.improved(limits.improvedContext, best(), bestcost, numEvaluations - startEvaluations);
+	}
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      bool cancelled = false;
+      if (limits.reportInterval > 0 && !(t % limits.reportInterval)) {
+	if (limits.progress) {
+	  cancelled = !limits.progress(limits.progressContext, numEvaluations - startEvaluations, bestcost);
+	} else {
+	  printf("gen=%lld, bestcost=%.20f, average=%.20f\n", t, bestcost, averageCost());
+	  printStatistics();
+	}
+      }
+      if (cancelled) {
+	result.reason = STOP_CANCELLED;
+      } else if (bestcost <= limits.targetCost) {
+	result.reason = STOP_TARGET;
+      } else if (limits.maxEvaluations > 0 && numEvaluations - startEvaluations >= limits.maxEvaluations) {
+	result.reason = STOP_EVALUATIONS;
+      } else if (limits.maxSeconds > 0 && seconds >= limits.maxSeconds) {
+	result.reason = STOP_TIME;
+      } else if (limits.stagnationWindow > 0 && numEvaluations - lastImprovement >= limits.stagnationWindow) {
+	result.reason = STOP_STAGNATION;
+      } else {
+	continue;
+      }
+      result.best = best();
+      result.cost = bestcost;
+      result.evaluations = numEvaluations - startEvaluations;
+      result.seconds = seconds;
+      return result;
+    }
+  }
   
   Recombinator::~Recombinator()
   {
   }
+
+
+  // Hardware performance counter profiler
+
+  Profiler::Profiler()
+  {
+    numOpen = 0;
+    current = -1;
+    numEvaluations = 0;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      fds[c] = -1;
+      order[c] = -1;
+      last[c] = 0;
+    }
+    for (int p = 0; p < NUM_PHASES; p++) {
+      for (int c = 0; c < NUM_COUNTERS; c++) {
+	totals[p][c] = 0;
+      }
+    }
+#ifdef __linux__
+    const unsigned long long cacheReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    unsigned int types[NUM_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    unsigned long long configs[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+						PERF_COUNT_HW_CACHE_L1D | cacheReadMiss, PERF_COUNT_HW_CACHE_LL | cacheReadMiss,
+						PERF_COUNT_HW_BRANCH_MISSES};
+    int leader = -1;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[c];
+      attr.config = configs[c];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.disabled = (leader == -1);
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+      if (fd < 0) {
+	if (leader == -1) return; // Without cycles there is no group
+	continue;
+      }
+      if (leader == -1) leader = fd;
+      fds[c] = fd;
+      order[c] = numOpen++;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  }
+
+  Profiler::~Profiler()
+  {
+#ifdef __linux__
+    for (int c = NUM_COUNTERS-1; c >= 0; c--) {
+      if (fds[c] >= 0) close(fds[c]);
+    }
+#endif
+  }
+
+  bool Profiler::available()
+  {
+    return numOpen > 0;
+  }
+
+  bool Profiler::read(long long *values)
+  {
+#ifdef __linux__
+    unsigned long long buffer[1+NUM_COUNTERS];
+    if (::read(fds[CYCLES], buffer, sizeof(buffer)) < (ssize_t)(sizeof(buffer[0])*(1+numOpen))) return false;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      values[c] = order[c] >= 0 ? buffer[1+order[c]] : 0;
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void Profiler::enter(Phase phase)
+  {
+    if (!numOpen) return;
+    long long values[NUM_COUNTERS];
+    if (!read(values)) {
+      // Leave the failed interval out of the phase totals
+      current = -1;
+      return;
+    }
+    if (current >= 0) {
+      for (int c = 0; c < NUM_COUNTERS; c++) {
+	totals[current][c] += values[c] - last[c];
+      }
+    }
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      last[c] = values[c];
+    }
+    current = phase;
+    if (phase == EVALUATION) numEvaluations++;
+  }
+
+  void Profiler::stop()
+  {
+    if (!numOpen || current < 0) return;
+    long long values[NUM_COUNTERS];
+    if (read(values)) {
+      for (int c = 0; c < NUM_COUNTERS; c++) {
+	totals[current][c] += values[c] - last[c];
+	last[c] = values[c];
+      }
+    }
+    current = -1;
+  }
+
+  void Profiler::print()
+  {
+    if (!numOpen) {
+      printf("profile: hardware counters unavailable\n");
+      return;
+    }
+    static const char *phaseNames[NUM_PHASES] = {"recombination", "evaluation", "bookkeeping"};
+    static const char *counterNames[NUM_COUNTERS] = {"cycles", "instructions", "L1D misses", "LL misses", "branch misses"};
+    double perEvaluation = numEvaluations > 0 ? 1.0/numEvaluations : 0;
+    printf("profile per evaluation:");
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      if (fds[c] >= 0) printf(" %s,", counterNames[c]);
+    }
+    printf(" IPC\n");
+    for (int p = 0; p < NUM_PHASES; p++) {
+      printf("  %-14s", phaseNames[p]);
+      for (int c = 0; c < NUM_COUNTERS; c++) {
+	if (fds[c] >= 0) printf(" %.1f", totals[p][c]*perEvaluation);
+      }
+      if (fds[INSTRUCTIONS] >= 0 && totals[p][CYCLES] > 0) {
+	printf(" %.2f", (double)totals[p][INSTRUCTIONS]/totals[p][CYCLES]);
+      }
+      printf("\n");
+    }
+  }
   
   
+  // Entry layout: key[numKeys], params[numParams], cost, evaluations,
+  // seconds, seed, time. All fields take a double's 8 bytes.
+  enum { ARCHIVE_FIELDS = 5 };
+  static const char archiveMagic[8] = {'O', 'P', 'T', 'I', 'A', 'R', 'C', '1'};
+
+  Archive::Archive(char const *fileName, int numParams, int numKeys)
+  {
+    this->numParams = numParams;
+    this->numKeys = numKeys;
+    stride = numKeys+numParams+ARCHIVE_FIELDS;
+    fields = new double[stride];
+    base = NULL;
+    size = 0;
+    fd = -1;
+#ifdef __linux__
+    if (!fileName) return;
+    fd = open(fileName, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return;
+    flock(fd, LOCK_EX);
+    struct stat status;
+    bool ok = !fstat(fd, &status);
+    if (ok && status.st_size == 0) {
+      // New file
+      Header header;
+      memcpy(header.magic, archiveMagic, sizeof(header.magic));
+      header.numParams = numParams;
+      header.numKeys = numKeys;
+      header.numEntries = 0;
+      header.capacity = 0;
+      ok = write(fd, &header, sizeof(header)) == sizeof(header);
+    }
+    ok = ok && refresh();
+    if (ok) {
+      Header *header = (Header *)base;
+      ok = !memcmp(header->magic, archiveMagic, sizeof(header->magic)) && header->numParams == (uint32_t)numParams && header->numKeys == (uint32_t)numKeys;
+    }
+    flock(fd, LOCK_UN);
+    if (!ok) {
+      if (base) munmap(base, size);
+      base = NULL;
+      close(fd);
+      fd = -1;
+    }
+#endif
+  }
+
+  Archive::~Archive()
+  {
+#ifdef __linux__
+    if (base) munmap(base, size);
+    if (fd >= 0) close(fd);
+#endif
+    delete[] fields;
+  }
+
+  bool Archive::isOpen()
+  {
+    return base != NULL;
+  }
+
+  bool Archive::refresh()
+  {
+#ifdef __linux__
+    struct stat status;
+    if (fstat(fd, &status) || status.st_size < (off_t)sizeof(Header)) return false;
+    if (base && (size_t)status.st_size == size) return true;
+    void *mapped = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) return false;
+    if (base) munmap(base, size);
+    base = (char *)mapped;
+    size = status.st_size;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool Archive::grow(uint64_t capacity)
+  {
+#ifdef __linux__
+    if (ftruncate(fd, sizeof(Header)+capacity*stride*sizeof(double))) return false;
+    if (!refresh()) return false;
+    ((Header *)base)->capacity = capacity;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  double *Archive::entry(int entry)
+  {
+    return (double *)(base+sizeof(Header))+(size_t)entry*stride;
+  }
+
+  // Map any growth of the file and return the number of entries, or -1 if
+  // the header does not fit the file. Call with the file locked.
+  int Archive::validEntries()
+  {
+    if (!refresh()) return -1;
+    Header *header = (Header *)base;
+    if (header->numEntries > header->capacity || header->capacity > (size-sizeof(Header))/(stride*sizeof(double))) return -1;
+    return (int)header->numEntries;
+  }
+
+  bool Archive::copyEntry(int entry, double *fields)
+  {
+    if (!base || entry < 0) return false;
+    bool ok = false;
+#ifdef __linux__
+    flock(fd, LOCK_SH);
+    if (entry < validEntries()) {
+      memcpy(fields, this->entry(entry), stride*sizeof(double));
+      ok = true;
+    }
+    flock(fd, LOCK_UN);
+#endif
+    return ok;
+  }
+
+  int Archive::getNumEntries()
+  {
+    if (!base) return 0;
+    int numEntries = 0;
+#ifdef __linux__
+    flock(fd, LOCK_SH);
+    numEntries = std::max(validEntries(), 0);
+    flock(fd, LOCK_UN);
+#endif
+    return numEntries;
+  }
+
+  double Archive::getEntry(int entry, double *key, double *params)
+  {
+    if (!copyEntry(entry, fields)) return DBL_MAX;
+    if (key) memcpy(key, fields, numKeys*sizeof(double));
+    if (params) memcpy(params, fields+numKeys, numParams*sizeof(double));
+    return fields[numKeys+numParams];
+  }
+
+  double Archive::getCost(int entry)
+  {
+    return copyEntry(entry, fields) ? fields[numKeys+numParams] : DBL_MAX;
+  }
+
+  long long Archive::getEvaluations(int entry)
+  {
+    long long evaluations = 0;
+    if (copyEntry(entry, fields)) memcpy(&evaluations, fields+numKeys+numParams+1, sizeof(evaluations));
+    return evaluations;
+  }
+
+  double Archive::getSeconds(int entry)
+  {
+    return copyEntry(entry, fields) ? fields[numKeys+numParams+2] : 0;
+  }
+
+  uint64_t Archive::getSeed(int entry)
+  {
+    uint64_t seed = 0;
+    if (copyEntry(entry, fields)) memcpy(&seed, fields+numKeys+numParams+3, sizeof(seed));
+    return seed;
+  }
+
+  long long Archive::getTime(int entry)
+  {
+    long long time = 0;
+    if (copyEntry(entry, fields)) memcpy(&time, fields+numKeys+numParams+4, sizeof(time));
+    return time;
+  }
+
+  int Archive::findLocked(double const *key, int numEntries)
+  {
+    for (int e = 0; e < numEntries; e++) {
+      if (!memcmp(entry(e), key, numKeys*sizeof(double))) return e;
+    }
+    return -1;
+  }
+
+  int Archive::find(double const *key)
+  {
+    if (!base) return -1;
+    int e = -1;
+#ifdef __linux__
+    flock(fd, LOCK_SH);
+    e = findLocked(key, validEntries());
+    flock(fd, LOCK_UN);
+#endif
+    return e;
+  }
+
+  int Archive::nearest(double const *key, int *entries, int num)
+  {
+    if (!base) return 0;
+#ifdef __linux__
+    flock(fd, LOCK_SH);
+    int numEntries = std::max(validEntries(), 0);
+    if (num > numEntries) num = numEntries;
+    double *distances = new double[numEntries];
+    for (int e = 0; e < numEntries; e++) {
+      double const *other = entry(e);
+      distances[e] = 0;
+      for (int k = 0; k < numKeys; k++) {
+	distances[e] += (other[k]-key[k])*(other[k]-key[k]);
+      }
+    }
+    flock(fd, LOCK_UN);
+    // Partial selection sort
+    for (int n = 0; n < num; n++) {
+      int nearest = -1;
+      for (int e = 0; e < numEntries; e++) {
+	if (distances[e] >= 0 && (nearest < 0 || distances[e] < distances[nearest])) nearest = e;
+      }
+      entries[n] = nearest;
+      distances[nearest] = -1;
+    }
+    delete[] distances;
+    return num;
+#else
+    return 0;
+#endif
+  }
+
+  bool Archive::store(double const *key, double const *params, double cost, long long evaluations, double seconds, uint64_t seed)
+  {
+    if (!base) return false;
+    bool stored = false;
+#ifdef __linux__
+    flock(fd, LOCK_EX);
+    int numEntries = validEntries();
+    if (numEntries < 0) {
+      // Truncated or corrupt file
+      flock(fd, LOCK_UN);
+      return false;
+    }
+    int e = findLocked(key, numEntries);
+    if (e < 0 || cost < entry(e)[numKeys+numParams]) {
+      Header *header = (Header *)base;
+      if (e < 0 && header->numEntries == header->capacity && !grow(header->capacity ? 2*header->capacity : 16)) {
+	flock(fd, LOCK_UN);
+	return false;
+      }
+      header = (Header *)base;
+      if (e < 0) e = (int)header->numEntries;
+      double *fields = entry(e);
+      long long now = ::time(NULL);
+      memcpy(fields, key, numKeys*sizeof(double));
+      memcpy(fields+numKeys, params, numParams*sizeof(double));
+      fields[numKeys+numParams] = cost;
+      memcpy(fields+numKeys+numParams+1, &evaluations, sizeof(evaluations));
+      fields[numKeys+numParams+2] = seconds;
+      memcpy(fields+numKeys+numParams+3, &seed, sizeof(seed));
+      memcpy(fields+numKeys+numParams+4, &now, sizeof(now));
+      // Publish a new entry only after it has been written
+      if (e == (int)header->numEntries) header->numEntries++;
+      stored = true;
+    }
+    flock(fd, LOCK_UN);
+#endif
+    return stored;
+  }
+
+  static const char publicationMagic[8] = {'O', 'P', 'T', 'I', 'P', 'U', 'B', '1'};
+
+  Publication::Publication(char const *name, int numParams, bool writer)
+  {
+    this->numParams = numParams;
+    this->writer = writer;
+    header = NULL;
+    words = NULL;
+    size = 0;
+#ifdef __linux__
+    if (!name) return;
+    int fd = shm_open(name, writer ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) return;
+    struct stat status;
+    bool ok = !fstat(fd, &status);
+    if (writer) {
+      size = sizeof(Header)+numParams*sizeof(uint64_t);
+      ok = ok && ((size_t)status.st_size == size || !ftruncate(fd, size));
+    } else {
+      size = ok ? status.st_size : 0;
+      ok = ok && size >= sizeof(Header);
+    }
+    void *mapped = ok ? mmap(NULL, size, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) return;
+    header = (Header *)mapped;
+    words = (std::atomic<uint64_t> *)(header+1);
+    bool same = !memcmp(header->magic, publicationMagic, sizeof(header->magic)) && size == sizeof(Header)+header->numParams*sizeof(uint64_t);
+    if (writer) {
+      if (!same || header->numParams != (uint32_t)numParams) {
+	// New or differently sized segment: start the versions over
+	header->sequence.store(0, std::memory_order_relaxed);
+	header->numParams = numParams;
+	memcpy(header->magic, publicationMagic, sizeof(header->magic));
+      } else if (header->sequence.load(std::memory_order_relaxed) & 1) {
+	// The previous writer stopped in mid-write
+	header->sequence.fetch_add(1, std::memory_order_release);
+      }
+    } else if (!same || (numParams && header->numParams != (uint32_t)numParams)) {
+      munmap(mapped, size);
+      header = NULL;
+      words = NULL;
+    } else {
+      this->numParams = header->numParams;
+    }
+#endif
+  }
+
+  Publication::~Publication()
+  {
+#ifdef __linux__
+    if (header) munmap(header, size);
+#endif
+  }
+
+  bool Publication::isOpen()
+  {
+    return header != NULL;
+  }
+
+  int Publication::getNumParams()
+  {
+    return numParams;
+  }
+
+  void Publication::publish(double const *params, double cost, long long evaluations)
+  {
+    if (!header || !writer) return;
+    uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+    header->sequence.store(sequence+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    uint64_t bits;
+    memcpy(&bits, &cost, sizeof(bits));
+    header->cost.store(bits, std::memory_order_relaxed);
+    header->evaluations.store(evaluations, std::memory_order_relaxed);
+    header->time.store(::time(NULL), std::memory_order_relaxed);
+    for (int i = 0; i < numParams; i++) {
+      memcpy(&bits, params+i, sizeof(bits));
+      words[i].store(bits, std::memory_order_relaxed);
+    }
+    header->sequence.store(sequence+2, std::memory_order_release);
+  }
+
+  uint64_t Publication::read(double *params, double &cost, long long &evaluations, long long &time)
+  {
+    if (!header) return 0;
+    // A write takes well under a microsecond, so a sequence that stays odd
+    // means that the writer is gone
+    for (int attempt = 0; attempt < 1000000; attempt++) {
+      uint64_t sequence = header->sequence.load(std::memory_order_acquire);
+      if (sequence & 1) continue;
+      uint64_t bits = header->cost.load(std::memory_order_relaxed);
+      memcpy(&cost, &bits, sizeof(bits));
+      evaluations = header->evaluations.load(std::memory_order_relaxed);
+      time = header->time.load(std::memory_order_relaxed);
+      for (int i = 0; i < numParams; i++) {
+	bits = words[i].load(std::memory_order_relaxed);
+	memcpy(params+i, &bits, sizeof(bits));
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header->sequence.load(std::memory_order_relaxed) == sequence) return sequence/2;
+    }
+    return 0;
+  }
+
+  bool Publication::remove(char const *name)
+  {
+#ifdef __linux__
+    return !shm_unlink(name);
+#else
+    return false;
+#endif
+  }
+
   // The PCX recombinator
     
   PCXRecombinator::PCXRecombinator(int numparents, double sd1, double sd2)
@@ -122,7 +997,7 @@ namespace Opti {
     delete[] meanvector;
   }
   
-  void PCXRecombinator::recombine(double *dest, double const *const *parents)
+  void PCXRecombinator::recombine(double *dest, double const *const *parents, Philox &rng)
   {
     int u,t;                  // variables used in for loops
         
@@ -149,20 +1024,20 @@ namespace Opti {
     for (t = 1; (t < numparents); t++) {
       meansquareddistance += squaredPerpendicularDistance(parents[0], meanvector, parents[t], numdimensions);
     }
-    meansquareddistance /= numparents-1;
+    if (numparents > 1) meansquareddistance /= numparents-1;
       
     double rmsdistance = sqrt(meansquareddistance);
       
     // 3. Random each dimension
+    rng.fillNormal(dest, numdimensions);
     if (meanvectorlengthsquared == 0) {
       for (u = 0; (u < numdimensions); u++) {
-	dest[u] = rng.randNorm(parents[0][u], sd2*rmsdistance);
+	dest[u] = parents[0][u] + dest[u]*(sd2*rmsdistance);
       }
     } else {
       double dotproduct = 0;
       double meanvectorlength = sqrt(meanvectorlengthsquared);
       for (u = 0; (u < numdimensions); u++) {		
-	dest[u] = rng.randNorm(0, 1);
 	dotproduct += dest[u]*meanvector[u];
       }
       for (u = 0; (u < numdimensions); u++) {
@@ -202,8 +1077,10 @@ namespace Opti {
     vector=new double[dim];
   }
   
-  G3::G3(Problem *problem, int populationsize, Recombinator *recombinator, int numOffspring)
+  G3::G3(Problem *problem, int populationsize, Recombinator *recombinator, int numOffspring, uint64_t seed)
   {
+    this->seed=seed;
+    this->iteration=0;
     this->recombinator=recombinator;
     recombinator->setNumDimensions(problem->getNumDimensions());
     this->numParents=recombinator->numParents();
@@ -221,15 +1098,139 @@ namespace Opti {
     for(int i=0;i<populationsize;i++)
       {
 	population[i].init(numdimensions);
+	Philox stream(seed, i, 0, INIT_STREAM);
+	stream.fillUniform(population[i].vector,numdimensions);
 	for(int j=0;j<numdimensions;j++)
 	  {
-	    population[i].vector[j]=min[j]+(max[j]-min[j])*rng.rand();
+	    population[i].vector[j]=min[j]+(max[j]-min[j])*population[i].vector[j];
 	  }
 	population[i].cost=problem->costFunction(population[i].vector,DBL_MAX);
+	numEvaluations++;
       }
     offspring.init(numdimensions);
      
     parentList=new double *[numParents+2];
+    profiler=NULL;
+    pool=NULL;
+    numFamilies=0;
+    offsprings=NULL;
+    compares=NULL;
+    familyParents=NULL;
+    seedings=0;
+  }
+
+  void G3::seedPopulation(double *minx, double *maxx, int num, int first)
+  {
+    if(first<1) first=1;
+    if(first+num>populationsize) num=populationsize-first;
+    for(int i=first;i<first+num;i++)
+      {
+	Philox stream(seed, i, seedings, SEED_STREAM);
+	stream.fillUniform(population[i].vector,numdimensions);
+	for(int j=0;j<numdimensions;j++)
+	  {
+	    population[i].vector[j]=minx[j]+(maxx[j]-minx[j])*population[i].vector[j];
+	  }
+	population[i].cost=isFinite(population[i].vector,numdimensions) ? problem->costFunction(population[i].vector,DBL_MAX) : DBL_MAX;
+	numEvaluations++;
+	if(population[i].cost<population[0].cost)
+	  population[i].swap(population[0]);
+      }
+    seedings++;
+  }
+
+  void G3::setParallel(ThreadPool *pool, int numFamilies)
+  {
+    delete [] offsprings;
+    delete [] compares;
+    delete [] familyParents;
+    offsprings=NULL;
+    compares=NULL;
+    familyParents=NULL;
+    this->pool=pool;
+    if(!pool)
+      return;
+    // The families must fit in population[1..populationsize-1]
+    int maxFamilies=(populationsize-1)/(numParents+1);
+    this->numFamilies=std::max(1,std::min(numFamilies,maxFamilies));
+    offsprings=new Individual[this->numFamilies*numOffspring];
+    for(int i=0;i<this->numFamilies*numOffspring;i++)
+      offsprings[i].init(numdimensions);
+    compares=new double[this->numFamilies*numOffspring];
+    familyParents=new double *[this->numFamilies*numParents];
+  }
+
+  double G3::evolveFamilies()
+  {
+    int i,f;
+    int familySize=numParents+1; // numParents-1 parents and 2 to replace
+    if(profiler) profiler->enter(Profiler::BOOKKEEPING);
+    // Choose the members of the families into population[1..]
+    Philox stream(seed, 0, iteration, EVOLVE_STREAM);
+    for(i=1;i<=numFamilies*familySize;i++)
+      {
+	int j=i+stream.randBounded(populationsize-i);
+	population[i].swap(population[j]);
+      }
+    if(profiler) profiler->enter(Profiler::RECOMBINATION);
+    for(f=0;f<numFamilies;f++)
+      {
+	Individual *members=&population[1+f*familySize];
+	double **parents=&familyParents[f*numParents];
+	parents[0]=population[0].vector;
+	for(i=1;i<numParents;i++)
+	  parents[i]=members[i-1].vector;
+	Philox familyStream(seed, 1+f, iteration, EVOLVE_STREAM);
+	std::swap(parents[0],parents[familyStream.randBounded(numParents)]);
+	double compare=std::max(members[numParents-1].cost,members[numParents].cost);
+	for(i=0;i<numOffspring;i++)
+	  {
+	    recombinator->recombine(offsprings[f*numOffspring+i].vector,parents,familyStream);
+	    compares[f*numOffspring+i]=compare;
+	  }
+      }
+    iteration++;
+    if(profiler) profiler->enter(Profiler::EVALUATION);
+    pool->parallelFor(numFamilies*numOffspring, [&](int k) {
+	Individual &child=offsprings[k];
+	child.cost=isFinite(child.vector,numdimensions) ? problem->costFunction(child.vector,compares[k]) : DBL_MAX;
+      });
+    numEvaluations+=numFamilies*numOffspring;
+    if(profiler) profiler->enter(Profiler::BOOKKEEPING);
+    // Replace as in the serial evolve, family by family
+    for(f=0;f<numFamilies;f++)
+      {
+	Individual *members=&population[1+f*familySize];
+	Individual *best=&members[numParents-1];
+	Individual *nextBest=&members[numParents];
+	if(nextBest->cost < best->cost)
+	  std::swap(best,nextBest);
+	for(i=0;i<numOffspring;i++)
+	  {
+	    Individual &child=offsprings[f*numOffspring+i];
+	    if(child.cost<nextBest->cost)
+	      {
+		nextBest->swap(child);
+		if(nextBest->cost < best->cost)
+		  std::swap(best,nextBest);
+	      }
+	  }
+	if(best->cost < population[0].cost)
+	  best->swap(population[0]);
+      }
+    if(profiler) profiler->stop();
+    return population[0].cost;
+  }
+
+  void G3::setProfiler(Profiler *profiler)
+  {
+    this->profiler=profiler;
+  }
+
+  void G3::printStatistics()
+  {
+    if(profiler)
+      profiler->print();
   }
   
   G3::~G3()
@@ -237,6 +1238,9 @@ namespace Opti {
     delete recombinator;
     delete [] population;
     delete [] parentList;
+    delete [] offsprings;
+    delete [] compares;
+    delete [] familyParents;
   }
   
   double *G3::best()
@@ -256,17 +1260,21 @@ namespace Opti {
   
   double G3::evolve()
   {
+    if(pool)
+      return evolveFamilies();
     int i;
     // population[0] contains best
+    if(profiler) profiler->enter(Profiler::BOOKKEEPING);
+    Philox stream(seed, 0, iteration++, EVOLVE_STREAM);
         
     for(i=1;i<numParents+2;i++)
       {
-	int j=i+rng.randInt(populationsize-i-1);
+	int j=i+stream.randBounded(populationsize-i);
 	population[i].swap(population[j]);
 	parentList[i]=population[i].vector;
       }
     parentList[0]=population[0].vector;
-    std::swap(parentList[0],parentList[rng.randInt(numParents-1)]);
+    std::swap(parentList[0],parentList[stream.randBounded(numParents)]);
       
     Individual *best=&population[numParents+0];
     Individual *nextBest=&population[numParents+1];
@@ -275,8 +1283,17 @@ namespace Opti {
       
     for(i=0;i<numOffspring;i++)
       {
-	recombinator->recombine(offspring.vector,parentList);
-	offspring.cost=problem->costFunction(offspring.vector,nextBest->cost);
+	if(profiler) profiler->enter(Profiler::RECOMBINATION);
+	recombinator->recombine(offspring.vector,parentList,stream);
+	if(profiler) profiler->enter(Profiler::EVALUATION);
+	if(isFinite(offspring.vector,numdimensions))
+	  {
+	    offspring.cost=problem->costFunction(offspring.vector,nextBest->cost);
+	    numEvaluations++;
+	  }
+	else
+	  offspring.cost=DBL_MAX;
+	if(profiler) profiler->enter(Profiler::BOOKKEEPING);
 	if(offspring.cost<nextBest->cost)
 	  {
 	    nextBest->swap(offspring);
@@ -286,10 +1303,218 @@ namespace Opti {
       }
     if(best->cost < population[0].cost)
       best->swap(population[0]);
+    if(profiler) profiler->stop();
       
     return population[0].cost;
   }
-  
+  
+  Surrogate::Surrogate(int capacity, int k, double margin, double auditRate, double maxFalseRejections)
+  {
+    assert(capacity >= k && k > 0);
+    this->capacity = capacity;
+    this->k = k;
+    this->margin = margin;
+    this->auditRate = auditRate;
+    this->maxFalseRejections = maxFalseRejections;
+    d = 0;
+    vectors = 0;
+    costs = new double[capacity];
+    nearestDistances = new double[k];
+    nearestCosts = new double[k];
+    num = 0;
+    next = 0;
+    enabled = true;
+    falseRejectionRate = 0;
+    screened = 0;
+    skipped = 0;
+    audits = 0;
+    falseRejections = 0;
+  }
+
+  Surrogate::~Surrogate()
+  {
+    delete[] vectors;
+    delete[] costs;
+    delete[] nearestDistances;
+    delete[] nearestCosts;
+  }
+
+  void Surrogate::setNumDimensions(int numDimensions)
+  {
+    d = numDimensions;
+    delete[] vectors;
+    vectors = new double[capacity*d];
+    num = 0;
+    next = 0;
+  }
+
+  double Surrogate::predict(double const *vector)
+  {
+    // Insertion sort of the k nearest by squared distance
+    int numNearest = 0;
+    for (int i = 0; i < num; i++) {
+      double const *v = &vectors[i*d];
+      double distance = 0;
+      for (int j = 0; j < d; j++) {
+	double diff = v[j] - vector[j];
+	distance += diff*diff;
+      }
+      if (numNearest == k && distance >= nearestDistances[k-1]) continue;
+      int t = (numNearest < k) ? numNearest++ : k-1;
+      for (; t > 0 && nearestDistances[t-1] > distance; t--) {
+	nearestDistances[t] = nearestDistances[t-1];
+	nearestCosts[t] = nearestCosts[t-1];
+      }
+      nearestDistances[t] = distance;
+      nearestCosts[t] = costs[i];
+    }
+    if (nearestDistances[0] == 0) return nearestCosts[0];
+    double sumWeights = 0;
+    double sumCosts = 0;
+    for (int t = 0; t < numNearest; t++) {
+      double weight = 1.0/nearestDistances[t];
+      sumWeights += weight;
+      sumCosts += weight*nearestCosts[t];
+    }
+    return sumCosts/sumWeights;
+  }
+
+  bool Surrogate::skip(double const *vector, double compare, Philox &rng, bool &wouldSkip)
+  {
+    screened++;
+    wouldSkip = false;
+    if (num < k) return false;
+    wouldSkip = predict(vector) - compare > margin*fabs(compare);
+    if (!wouldSkip) return false;
+    if (enabled && rng.randExc() >= auditRate) {
+      skipped++;
+      return true;
+    }
+    return false;
+  }
+
+  void Surrogate::evaluated(double const *vector, double cost, double compare, bool wouldSkip)
+  {
+    if (wouldSkip) {
+      // Audit: was the rejection wrong?
+      const double alpha = 1.0/64;
+      bool improved = cost < compare;
+      audits++;
+      if (improved) falseRejections++;
+      falseRejectionRate += alpha*((improved ? 1.0 : 0.0) - falseRejectionRate);
+      enabled = falseRejectionRate <= maxFalseRejections;
+    }
+    if (cost >= compare) return;
+    memcpy(&vectors[next*d], vector, sizeof(double)*d);
+    costs[next] = cost;
+    if (++next >= capacity) next = 0;
+    if (num < capacity) num++;
+  }
+
+  void Surrogate::clear()
+  {
+    num = 0;
+    next = 0;
+  }
+
+  void Surrogate::print()
+  {
+    printf("surrogate %s: screened=%lld, skipped=%lld, audits=%lld, false rejections=%lld, rate=%f\n",
+	   enabled ? "on" : "off", screened, skipped, audits, falseRejections, falseRejectionRate);
+  }
+
+  EvaluationCache::EvaluationCache(int capacity, int dropBits)
+  {
+    this->capacity = 1;
+    while (this->capacity < capacity) this->capacity *= 2;
+    mask = ~(((uint64_t)1 << dropBits) - 1);
+    d = 0;
+    keys = NULL;
+    vectors = NULL;
+    costs = new double[this->capacity];
+    exact = new bool[this->capacity];
+    used = new bool[this->capacity]();
+    lookups = hits = boundHits = 0;
+  }
+
+  EvaluationCache::~EvaluationCache()
+  {
+    delete[] keys;
+    delete[] vectors;
+    delete[] costs;
+    delete[] exact;
+    delete[] used;
+  }
+
+  void EvaluationCache::setNumDimensions(int numDimensions)
+  {
+    if (numDimensions != d) {
+      d = numDimensions;
+      delete[] keys;
+      delete[] vectors;
+      keys = new uint64_t[capacity*d];
+      vectors = new double[capacity*d];
+      for (int i = 0; i < capacity; i++) used[i] = false;
+    }
+  }
+
+  int EvaluationCache::slot(uint64_t const *key)
+  {
+    // FNV-1a over the words, then the high bits of a multiplicative hash
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < d; i++) {
+      hash = (hash ^ key[i])*0x100000001b3ULL;
+    }
+    return (int)((hash*0x9E3779B97F4A7C15ULL) >> 32) & (capacity-1);
+  }
+
+  bool EvaluationCache::lookup(double *vector, double compare, double &cost, uint64_t *key)
+  {
+    lookups++;
+    for (int i = 0; i < d; i++) {
+      uint64_t bits;
+      memcpy(&bits, &vector[i], sizeof(bits));
+      key[i] = bits & mask;
+    }
+    int s = slot(key);
+    if (!used[s] || memcmp(&keys[s*d], key, d*sizeof(uint64_t))) {
+      return false;
+    }
+    if (exact[s]) {
+      hits++;
+      cost = costs[s];
+      memcpy(vector, &vectors[s*d], d*sizeof(double));
+      return true;
+    }
+    if (costs[s] >= compare) {
+      boundHits++;
+      cost = compare;
+      return true;
+    }
+    return false;
+  }
+
+  void EvaluationCache::store(uint64_t const *key, double const *vector, double cost, double compare)
+  {
+    int s = slot(key);
+    memcpy(&keys[s*d], key, d*sizeof(uint64_t));
+    memcpy(&vectors[s*d], vector, d*sizeof(double));
+    used[s] = true;
+    exact[s] = cost < compare;
+    costs[s] = exact[s] ? cost : compare;
+  }
+
+  void EvaluationCache::clear()
+  {
+    for (int i = 0; i < capacity; i++) used[i] = false;
+  }
+
+  void EvaluationCache::print()
+  {
+    printf("cache: lookups=%lld, hits=%lld, bound hits=%lld, saved=%.2f%%\n",
+	   lookups, hits, boundHits, lookups ? 100.0*(hits + boundHits)/lookups : 0.0);
+  }
+
   // Get latest best parameter vector in population
   double *DE::best()
   {
@@ -309,6 +1534,7 @@ namespace Opti {
     bestcost = DBL_MAX;
     for (int t = 0; (t < np); t++) {
       costs[t] = problem->costFunction(&population[t*d], DBL_MAX);
+      numEvaluations++;
       sumcost += costs[t];
       if (costs[t] < bestcost) {
 	bestcost = costs[t];
@@ -327,27 +1553,71 @@ namespace Opti {
   void DE::randomPopulation(double *minx, double *maxx)
   {
     for (int member = 0; (member < np); member++) {
+      Philox stream(seed, member, 0, INIT_STREAM);
+      stream.fillUniform(&population[member*d], d);
       for (int param = 0; (param < d); param++) {
-	population[member*d+param] = rng.rand(maxx[param]-minx[param])+minx[param];
+	population[member*d+param] = population[member*d+param]*(maxx[param]-minx[param])+minx[param];
       }
     }
     _best = NULL;
   }
+
+  void DE::seedPopulation(double *minx, double *maxx, int num, int first)
+  {
+    if (first+num > np) num = np-first;
+    for (int member = first; (member < first+num); member++) {
+      Philox stream(seed, member, seedings, SEED_STREAM);
+      stream.fillUniform(&population[member*d], d);
+      for (int param = 0; (param < d); param++) {
+	population[member*d+param] = population[member*d+param]*(maxx[param]-minx[param])+minx[param];
+      }
+      costs[member] = problem->costFunction(&population[member*d], DBL_MAX);
+      numEvaluations++;
+    }
+    sumcost = 0;
+    bestcost = DBL_MAX;
+    for (int t = 0; (t < np); t++) {
+      sumcost += costs[t];
+      if (costs[t] < bestcost) {
+	bestcost = costs[t];
+	_best = &population[t*d];
+      }
+    }
+    seedings++;
+  }
   
   double DE::evolve()
   {
+    if (generational) return evolveGeneration();
     // The first of the parents is the destination vector
     // (so that DERecombinator can do crossover)
     parents[0] = &population[pos*d];
-    // Pick additional numparents-1 parents at random
-    partialShuffle(permuter, np, numparents-1);
+    if (profiler) profiler->enter(Profiler::RECOMBINATION);
+    // The random stream of this individual in this generation
+    Philox stream(seed, pos, generation, EVOLVE_STREAM);
+    // Pick additional numparents-1 distinct parents at random
+    distinctRandom(permuter, np, numparents-1, stream);
     for (int t = 1; t < numparents; t++) {
-      parents[t] = &population[permuter[t+1]*d];
+      parents[t] = &population[permuter[t-1]*d];
     }
     // Recombine parents into trialvector
-    recombinator->recombine(trialvector, parents);
-    // Get cost of trialvector
-    double trialcost = problem->costFunction(trialvector, costs[pos]);
+    recombinator->recombine(trialvector, parents, stream);
+    // Get cost of trialvector, unless it is cached or the surrogate
+    // predicts it is clearly worse
+    double trialcost = DBL_MAX;
+    bool wouldSkip = false;
+    if (cache && cache->lookup(trialvector, costs[pos], trialcost, cachekeys)) {
+      // Counted as an evaluation, so that limits still apply when a
+      // collapsed population makes only cached trials
+      numEvaluations++;
+    } else if (!surrogate || !surrogate->skip(trialvector, costs[pos], stream, wouldSkip)) {
+      if (profiler) profiler->enter(Profiler::EVALUATION);
+      trialcost = problem->costFunction(trialvector, costs[pos]);
+      numEvaluations++;
+      if (surrogate) surrogate->evaluated(trialvector, trialcost, costs[pos], wouldSkip);
+      if (cache) cache->store(cachekeys, trialvector, trialcost, costs[pos]);
+    }
+    if (profiler) profiler->enter(Profiler::BOOKKEEPING);
     // If better than destination vector, replace it
     if (trialcost < costs[pos]) {
       memcpy(&population[pos*d], trialvector, sizeof(double)*d);
@@ -365,37 +1635,205 @@ namespace Opti {
     // If we have browsed through the whole population...
     if (++pos >= np) {
       pos = 0;
+      generation++;
       // Reset sumcost to a stable value
       // to avoid drift in floating point accumulation
       sumcost = gencost;
       // Restart gencost
       gencost = 0;
     }
+    if (profiler) profiler->stop();
+    return bestcost;
+  }
+
+  double DE::evolveGeneration()
+  {
+    if (profiler) profiler->enter(Profiler::RECOMBINATION);
+    // Trials from the population at the start of the generation
+    int numTrials = 0;
+    for (int member = 0; member < np; member++) {
+      double *trial = &trialvectors[member*d];
+      parents[0] = &population[member*d];
+      Philox stream(seed, member, generation, EVOLVE_STREAM);
+      distinctRandom(permuter, np, numparents-1, stream);
+      for (int t = 1; t < numparents; t++) {
+	parents[t] = &population[permuter[t-1]*d];
+      }
+      recombinator->recombine(trial, parents, stream);
+      trialcosts[member] = DBL_MAX;
+      bool wouldSkip = false;
+      if (cache && cache->lookup(trial, costs[member], trialcosts[member], &cachekeys[member*d])) {
+	numEvaluations++;  // As in evolve
+      } else if (!surrogate || !surrogate->skip(trial, costs[member], stream, wouldSkip)) {
+	trialpointers[numTrials] = trial;
+	comparecosts[numTrials] = costs[member];
+	wouldskips[numTrials] = wouldSkip;
+	numTrials++;
+      }
+    }
+    if (profiler) profiler->enter(Profiler::EVALUATION);
+    // Costs of the evaluated trials, stored compactly at the end of
+    // comparecosts and then spread to trialcosts by member
+    double *batchcosts = &comparecosts[np];
+    problem->costFunctionBatch(trialpointers, comparecosts, batchcosts, numTrials);
+    numEvaluations += numTrials;
+    if (profiler) profiler->enter(Profiler::BOOKKEEPING);
+    for (int t = 0; t < numTrials; t++) {
+      int member = (trialpointers[t] - trialvectors)/d;
+      trialcosts[member] = batchcosts[t];
+      if (surrogate) surrogate->evaluated(trialpointers[t], batchcosts[t], comparecosts[t], wouldskips[t]);
+      if (cache) cache->store(&cachekeys[member*d], trialpointers[t], batchcosts[t], comparecosts[t]);
+    }
+    // Replace members by better trials
+    sumcost = 0;
+    for (int member = 0; member < np; member++) {
+      if (trialcosts[member] < costs[member]) {
+	memcpy(&population[member*d], &trialvectors[member*d], sizeof(double)*d);
+	costs[member] = trialcosts[member];
+	if (costs[member] < bestcost) {
+	  bestcost = costs[member];
+	  _best = &population[member*d];
+	}
+      }
+      sumcost += costs[member];
+    }
+    generation++;
+    pos = 0;
+    gencost = 0;
+    if (profiler) profiler->stop();
     return bestcost;
   }
 
-  DE::DE(Problem *problem, int np, Recombinator *recombinator)
+  void DE::setGenerational(bool generational)
+  {
+    this->generational = generational;
+    if (generational && !trialvectors) {
+      trialvectors = new double[np*d];
+      trialpointers = new double *[np];
+      trialcosts = new double[np];
+      comparecosts = new double[2*np];
+      wouldskips = new bool[np];
+    }
+  }
+
+  DE::DE(Problem *problem, int np, Recombinator *recombinator, uint64_t seed)
   {
+    this->seed = seed;
+    this->generation = 0;
+    this->seedings = 0;
     this->problem=problem;
     this->np = np;
     this->d = problem->getNumDimensions();
     recombinator->setNumDimensions(d);
     this->recombinator = recombinator;
     this->trialvector = new double[d];
+    this->generational = false;
+    this->trialvectors = NULL;
+    this->trialpointers = NULL;
+    this->trialcosts = NULL;
+    this->comparecosts = NULL;
+    this->wouldskips = NULL;
+    this->surrogate = NULL;
+    this->cache = NULL;
+    this->cachekeys = NULL;
+    this->profiler = NULL;
     numparents = recombinator->numParents();
     parents = new double *[numparents];
     population = new double[np*d];
     costs = new double[np];
-    permuter = new int[np];
-    for (int member = 0; (member < np); member++) {
-      permuter[member] = member;
-    }
+    permuter = new int[numparents];
     randomPopulation(problem->getMin(), problem->getMax()); // Initialize population
     pos = 0; // Point at first parent
     gencost = 0;
     statistics();
   }
   
+  void DE::setSurrogate(Surrogate *surrogate)
+  {
+    this->surrogate = surrogate;
+    if (surrogate) surrogate->setNumDimensions(d);
+  }
+
+  void DE::setCache(EvaluationCache *cache)
+  {
+    this->cache = cache;
+    if (cache) {
+      cache->setNumDimensions(d);
+      if (!cachekeys) cachekeys = new uint64_t[np*d];
+    }
+  }
+
+  void DE::setProfiler(Profiler *profiler)
+  {
+    this->profiler = profiler;
+  }
+
+  void DE::inject(double const *vector, double cost)
+  {
+    int worst = 0;
+    for (int t = 1; t < np; t++) {
+      if (costs[t] > costs[worst]) worst = t;
+    }
+    memcpy(&population[worst*d], vector, d*sizeof(double));
+    sumcost += cost - costs[worst];
+    costs[worst] = cost;
+    if (cost < bestcost || _best == &population[worst*d]) {
+      // The worst was the best only if all costs were equal
+      bestcost = DBL_MAX;
+      for (int t = 0; t < np; t++) {
+	if (costs[t] < bestcost) {
+	  bestcost = costs[t];
+	  _best = &population[t*d];
+	}
+      }
+    }
+  }
+
+  double DE::rescore(ThreadPool *pool)
+  {
+    double **pointers = new double *[np];
+    double *compare = new double[np];
+    for (int t = 0; t < np; t++) {
+      pointers[t] = &population[t*d];
+      compare[t] = DBL_MAX;
+    }
+    if (pool) {
+      int numBatches = std::min(np, 4*pool->getNumThreads());
+      pool->parallelFor(numBatches, [&](int batch) {
+	int begin = np*batch/numBatches;
+	int end = np*(batch+1)/numBatches;
+	problem->costFunctionBatch(pointers+begin, compare+begin, costs+begin, end-begin);
+      });
+    } else {
+      problem->costFunctionBatch(pointers, compare, costs, np);
+    }
+    numEvaluations += np;
+    delete[] pointers;
+    delete[] compare;
+    sumcost = 0;
+    gencost = 0;
+    bestcost = DBL_MAX;
+    for (int t = 0; t < np; t++) {
+      sumcost += costs[t];
+      // gencost sums the costs of the members already visited this generation
+      if (t < pos) gencost += costs[t];
+      if (costs[t] < bestcost) {
+	bestcost = costs[t];
+	_best = &population[t*d];
+      }
+    }
+    if (cache) cache->clear();
+    if (surrogate) surrogate->clear();
+    return bestcost;
+  }
+
+  void DE::printStatistics()
+  {
+    if (cache) cache->print();
+    if (surrogate) surrogate->print();
+    if (profiler) profiler->print();
+  }
+
   // Destructor
   DE::~DE() {
     delete[] population;
@@ -403,12 +1841,586 @@ namespace Opti {
     delete[] permuter;
     delete[] parents;
     delete[] trialvector;
+    delete[] trialvectors;
+    delete[] trialpointers;
+    delete[] trialcosts;
+    delete[] comparecosts;
+    delete[] wouldskips;
+    delete[] cachekeys;
+  }
+
+  // Proximal bundle minimax
+  Minimax::Minimax(Problem *problem, double const *start, int maxPieces, double tolerance, double mu)
+  {
+    this->problem = problem;
+    this->maxPieces = maxPieces;
+    this->tolerance = tolerance;
+    this->mu = mu;
+    d = problem->getNumDimensions();
+    point = new double[d];
+    values = new double[maxPieces];
+    gradients = new double[maxPieces*d];
+    lambda = new double[maxPieces];
+    v = new double[d];
+    trial = new double[d];
+    numPieces = 0;
+    accepted = 0;
+    rejected = 0;
+    memcpy(point, start, d*sizeof(double));
+    cost = problem->costFunction(point, DBL_MAX);
+    numEvaluations++;
+  }
+
+  Minimax::~Minimax()
+  {
+    delete[] point;
+    delete[] values;
+    delete[] gradients;
+    delete[] lambda;
+    delete[] v;
+    delete[] trial;
+  }
+
+  double *Minimax::best()
+  {
+    return point;
+  }
+
+  double Minimax::averageCost()
+  {
+    return cost;
+  }
+
+  double Minimax::evolve()
+  {
+    cost = step(point, cost);
+    return cost;
+  }
+
+  double Minimax::refine(double *params, int numSteps)
+  {
+    double paramsCost = problem->costFunction(params, DBL_MAX);
+    numEvaluations++;
+    for (int i = 0; i < numSteps; i++) {
+      paramsCost = step(params, paramsCost);
+    }
+    return paramsCost;
+  }
+
+  double Minimax::step(double *params, double paramsCost)
+  {
+    numPieces = problem->activePieces(params, tolerance*paramsCost, values, gradients, maxPieces);
+    numEvaluations++;
+    if (numPieces == 0) return paramsCost;
+    // Frank-Wolfe on the dual: maximize sum(lambda f) - mu/2 |sum(lambda g)|^2
+    // over the simplex, starting from the largest piece
+    for (int i = 0; i < numPieces; i++) lambda[i] = 0;
+    lambda[0] = 1;
+    memcpy(v, gradients, d*sizeof(double));
+    double lambdaF = values[0];
+    for (int iteration = 0; iteration < 200; iteration++) {
+      // The piece with the largest partial derivative of the dual
+      int vertex = 0;
+      double bestSlope = -DBL_MAX;
+      for (int i = 0; i < numPieces; i++) {
+	double gv = 0;
+	for (int k = 0; k < d; k++) gv += gradients[i*d+k]*v[k];
+	double slope = values[i] - mu*gv;
+	if (slope > bestSlope) {
+	  bestSlope = slope;
+	  vertex = i;
+	}
+      }
+      // Exact line search towards the vertex
+      double const *g = &gradients[vertex*d];
+      double vDotDiff = 0, diffSquared = 0;
+      for (int k = 0; k < d; k++) {
+	vDotDiff += v[k]*(g[k]-v[k]);
+	diffSquared += (g[k]-v[k])*(g[k]-v[k]);
+      }
+      double numerator = values[vertex] - lambdaF - mu*vDotDiff;
+      if (numerator <= 1e-15*fabs(lambdaF) || diffSquared == 0) break;
+      double gamma = std::min(1.0, numerator/(mu*diffSquared));
+      for (int i = 0; i < numPieces; i++) lambda[i] *= 1-gamma;
+      lambda[vertex] += gamma;
+      for (int k = 0; k < d; k++) v[k] += gamma*(g[k]-v[k]);
+      lambdaF += gamma*(values[vertex]-lambdaF);
+    }
+    // The primal step is d = -mu v
+    for (int k = 0; k < d; k++) trial[k] = params[k] - mu*v[k];
+    double trialCost = problem->costFunction(trial, paramsCost);
+    numEvaluations++;
+    if (trialCost < paramsCost) {
+      memcpy(params, trial, d*sizeof(double));
+      mu *= 2;
+      accepted++;
+      return trialCost;
+    }
+    mu *= 0.25;
+    rejected++;
+    return paramsCost;
+  }
+
+  void Minimax::printStatistics()
+  {
+    printf("minimax: mu %g, %d active pieces, %lld steps taken, %lld rejected\n", mu, numPieces, accepted, rejected);
+  }
+
+  // Restarts
+  Restarts::Restarts(StrategyFactory factory, void *context, int numDimensions, int populationSize, Regime regime, uint64_t seed)
+  {
+    this->factory = factory;
+    this->context = context;
+    this->regime = regime;
+    this->seed = seed;
+    d = numDimensions;
+    spreadTolerance = 1e-9;
+    stagnationGenerations = 100;
+    basePopulation = populationSize;
+    maxPopulation = 64*populationSize;
+    largePopulation = populationSize;
+    this->populationSize = populationSize;
+    large = true;
+    elite = new double[d];
+    eliteCost = DBL_MAX;
+    recordCapacity = 16;
+    records = new Record[recordCapacity];
+    numRecords = 0;
+    largeEvaluations = 0;
+    smallEvaluations = 0;
+    pastEvaluations = 0;
+    // The first run uses the seed itself, so without restarts it is the
+    // same as the strategy alone
+    strategy = factory(context, populationSize, seed, NULL, DBL_MAX);
+    runStart = 0;
+    lastImprovement = 0;
+    calls = 0;
+    runCost = DBL_MAX;
+    runAverage = DBL_MAX;
+  }
+
+  Restarts::~Restarts()
+  {
+    delete strategy;
+    delete[] elite;
+    delete[] records;
+  }
+
+  void Restarts::setCriteria(double spreadTolerance, long long stagnationGenerations)
+  {
+    this->spreadTolerance = spreadTolerance;
+    this->stagnationGenerations = stagnationGenerations;
+  }
+
+  void Restarts::setMaxPopulation(int maxPopulation)
+  {
+    this->maxPopulation = maxPopulation;
+  }
+
+  double *Restarts::best()
+  {
+    return eliteCost < DBL_MAX ? elite : strategy->best();
+  }
+
+  double Restarts::averageCost()
+  {
+    return strategy->averageCost();
+  }
+
+  Strategy *Restarts::current()
+  {
+    return strategy;
+  }
+
+  int Restarts::getNumRestarts()
+  {
+    return numRecords;
+  }
+
+  Restarts::Record const &Restarts::getRecord(int restart)
+  {
+    return records[restart];
+  }
+
+  double Restarts::evolve()
+  {
+    double cost = strategy->evolve();
+    numEvaluations = pastEvaluations + strategy->evaluations();
+    if (cost < runCost) {
+      if (runCost - cost > 1e-12*fabs(runCost)) lastImprovement = numEvaluations;
+      runCost = cost;
+    }
+    if (cost < eliteCost) {
+      memcpy(elite, strategy->best(), d*sizeof(double));
+      eliteCost = cost;
+    }
+    // Check the criteria about once a generation. A run that includes the
+    // elite may not beat it for long, so a falling average cost also
+    // counts as improvement.
+    if (++calls % populationSize == 0) {
+      double average = strategy->averageCost();
+      if (runAverage - average > 1e-12*fabs(runAverage)) {
+	lastImprovement = numEvaluations;
+	runAverage = average;
+      }
+      bool collapsed = average - runCost <= spreadTolerance*fabs(runCost);
+      if (collapsed || numEvaluations - lastImprovement >= stagnationGenerations*populationSize) {
+	restart(collapsed);
+      }
+    }
+    return eliteCost;
+  }
+
+  void Restarts::restart(bool collapsed)
+  {
+    if (numRecords == recordCapacity) {
+      Record *more = new Record[2*recordCapacity];
+      memcpy(more, records, numRecords*sizeof(Record));
+      delete[] records;
+      records = more;
+      recordCapacity *= 2;
+    }
+    Record &record = records[numRecords++];
+    record.populationSize = populationSize;
+    record.large = large;
+    record.collapsed = collapsed;
+    record.evaluations = numEvaluations - runStart;
+    record.cost = runCost;
+    if (large) {
+      largeEvaluations += record.evaluations;
+    } else {
+      smallEvaluations += record.evaluations;
+    }
+    pastEvaluations = numEvaluations;
+    delete strategy;
+    // Choose the regime and population size of the next run
+    Philox stream(seed, numRecords, 0, RESTART_STREAM);
+    uint64_t runSeed = (uint64_t)stream.randInt() << 32;
+    runSeed |= stream.randInt();
+    large = regime == IPOP || smallEvaluations >= largeEvaluations;
+    if (large) {
+      largePopulation = std::min(2*largePopulation, maxPopulation);
+      populationSize = largePopulation;
+    } else {
+      double u = stream.randExc();
+      populationSize = (int)(basePopulation*pow((double)largePopulation/basePopulation, u*u));
+    }
+    strategy = factory(context, populationSize, runSeed, elite, eliteCost);
+    numEvaluations = pastEvaluations + strategy->evaluations();
+    runStart = pastEvaluations;
+    lastImprovement = numEvaluations;
+    calls = 0;
+    runCost = DBL_MAX;
+    runAverage = DBL_MAX;
+  }
+
+  void Restarts::printStatistics()
+  {
+    strategy->printStatistics();
+    printf("restarts: %d, %s run of population %d, %lld evaluations in large runs, %lld in small\n", numRecords, large ? "large" : "small", populationSize, largeEvaluations, smallEvaluations);
+  }
+
+  void Restarts::printRecords()
+  {
+    for (int i = 0; i < numRecords; i++) {
+      Record const &record = records[i];
+      printf("run %d: %s population %d, %lld evaluations, cost %.20f, %s\n", i, record.large ? "large" : "small", record.populationSize, record.evaluations, record.cost, record.collapsed ? "collapsed" : "stagnated");
+    }
+    printf("run %d: %s population %d, %lld evaluations, cost %.20f, stopped\n", numRecords, large ? "large" : "small", populationSize, numEvaluations - runStart, runCost);
+  }
+
+  // Continuation
+  Continuation::Continuation(DE *de, ContinuationStep step, void *context, int numSteps, long long stepEvaluations, ThreadPool *pool)
+  {
+    this->de = de;
+    this->step = step;
+    this->context = context;
+    this->numSteps = numSteps > 0 ? numSteps : 1;
+    this->stepEvaluations = stepEvaluations;
+    this->pool = pool;
+    stepNumber = 0;
+    step(context, 0);
+    stepCost = de->rescore(pool);
+    numEvaluations = de->evaluations();
+    stepStart = numEvaluations;
+  }
+
+  Continuation::~Continuation()
+  {
+    delete de;
+  }
+
+  double *Continuation::best()
+  {
+    return de->best();
+  }
+
+  double Continuation::averageCost()
+  {
+    return de->averageCost();
+  }
+
+  double Continuation::getPosition()
+  {
+    return (double)stepNumber/numSteps;
+  }
+
+  bool Continuation::atTarget()
+  {
+    return stepNumber == numSteps;
+  }
+
+  double Continuation::evolve()
+  {
+    stepCost = de->evolve();
+    numEvaluations = de->evaluations();
+    if (stepNumber < numSteps && numEvaluations - stepStart >= stepEvaluations) {
+      stepNumber++;
+      step(context, stepNumber == numSteps ? 1.0 : getPosition());
+      stepCost = de->rescore(pool);
+      numEvaluations = de->evaluations();
+      stepStart = numEvaluations;
+    }
+    return atTarget() ? stepCost : DBL_MAX;
+  }
+
+  void Continuation::printStatistics()
+  {
+    de->printStatistics();
+    printf("continuation: step %d/%d at position %g, cost %.20f\n", stepNumber, numSteps, getPosition(), stepCost);
+  }
+
+  // NSGA-II
+  NSGA2::NSGA2(Problem *problem, int populationsize, Recombinator *recombinator, uint64_t seed)
+  {
+    this->problem = problem;
+    this->recombinator = recombinator;
+    this->populationsize = populationsize;
+    this->seed = seed;
+    generation = 0;
+    seedings = 0;
+    d = problem->getNumDimensions();
+    m = problem->getNumObjectives();
+    recombinator->setNumDimensions(d);
+    numParents = recombinator->numParents();
+    int num = 2*populationsize;
+    vectors = new double[num*d];
+    costs = new double[num*m];
+    ranks = new int[num];
+    crowding = new double[num];
+    order = new int[num];
+    remaining = new int[num];
+    newVectors = new double[num*d];
+    newCosts = new double[num*m];
+    newRanks = new int[num];
+    newCrowding = new double[num];
+    parents = new double *[numParents];
+    permuter = new int[numParents];
+    double *min = problem->getMin();
+    double *max = problem->getMax();
+    for (int member = 0; member < populationsize; member++) {
+      Philox stream(seed, member, 0, INIT_STREAM);
+      stream.fillUniform(&vectors[member*d], d);
+      for (int param = 0; param < d; param++) {
+	vectors[member*d+param] = vectors[member*d+param]*(max[param]-min[param])+min[param];
+      }
+      evaluate(member);
+    }
+    select(populationsize);
+  }
+
+  NSGA2::~NSGA2()
+  {
+    delete[] vectors;
+    delete[] costs;
+    delete[] ranks;
+    delete[] crowding;
+    delete[] order;
+    delete[] remaining;
+    delete[] newVectors;
+    delete[] newCosts;
+    delete[] newRanks;
+    delete[] newCrowding;
+    delete[] parents;
+    delete[] permuter;
+  }
+
+  void NSGA2::evaluate(int member)
+  {
+    double *memberCosts = &costs[member*m];
+    problem->costVector(&vectors[member*d], memberCosts);
+    numEvaluations++;
+    // Non-finite objectives would break dominance and crowding
+    for (int k = 0; k < m; k++) {
+      if (!isFinite(memberCosts[k])) memberCosts[k] = DBL_MAX;
+    }
+  }
+
+  void NSGA2::seedPopulation(double *minx, double *maxx, int num, int first)
+  {
+    if (first+num > populationsize) num = populationsize-first;
+    for (int member = first; member < first+num; member++) {
+      Philox stream(seed, member, seedings, SEED_STREAM);
+      stream.fillUniform(&vectors[member*d], d);
+      for (int param = 0; param < d; param++) {
+	vectors[member*d+param] = vectors[member*d+param]*(maxx[param]-minx[param])+minx[param];
+      }
+      evaluate(member);
+    }
+    select(populationsize);
+    seedings++;
+  }
+
+  void NSGA2::select(int num)
+  {
+    // Peel off the fronts: each one is the members not dominated by any
+    // other member still remaining. All remaining members are classified
+    // before the dominated ones are compacted for the next pass.
+    int numRemaining = num;
+    for (int i = 0; i < num; i++) remaining[i] = i;
+    for (int rank = 0; numRemaining > 0; rank++) {
+      int frontBegin = num-numRemaining;
+      int frontEnd = frontBegin;
+      for (int r = 0; r < numRemaining; r++) {
+	int i = remaining[r];
+	bool dominated = false;
+	for (int s = 0; s < numRemaining && !dominated; s++) {
+	  int j = remaining[s];
+	  bool noWorse = true, better = false;
+	  for (int k = 0; k < m; k++) {
+	    if (costs[j*m+k] > costs[i*m+k]) noWorse = false;
+	    if (costs[j*m+k] < costs[i*m+k]) better = true;
+	  }
+	  dominated = noWorse && better;
+	}
+	if (dominated) {
+	  ranks[i] = -1;
+	} else {
+	  order[frontEnd++] = i;
+	  ranks[i] = rank;
+	  crowding[i] = 0;
+	}
+      }
+      int numNext = 0;
+      for (int r = 0; r < numRemaining; r++) {
+	if (ranks[remaining[r]] < 0) remaining[numNext++] = remaining[r];
+      }
+      numRemaining = numNext;
+      // Crowding distance: the sum over objectives of the normalized
+      // distance between the neighbours, infinite at the extremes
+      int *front = &order[frontBegin];
+      int frontNum = frontEnd-frontBegin;
+      for (int k = 0; k < m; k++) {
+	std::sort(front, front+frontNum, [&](int a, int b) { return costs[a*m+k] < costs[b*m+k]; });
+	double range = costs[front[frontNum-1]*m+k] - costs[front[0]*m+k];
+	crowding[front[0]] = crowding[front[frontNum-1]] = DBL_MAX;
+	if (range <= 0) continue;
+	for (int f = 1; f < frontNum-1; f++) {
+	  if (crowding[front[f]] < DBL_MAX) {
+	    crowding[front[f]] += (costs[front[f+1]*m+k] - costs[front[f-1]*m+k])/range;
+	  }
+	}
+      }
+      if (frontEnd >= populationsize) {
+	// Fill the rest of the population from this front by crowding
+	std::sort(front, front+frontNum, [&](int a, int b) { return crowding[a] > crowding[b]; });
+	break;
+      }
+    }
+    // Keep the best populationsize by rank and objective 0
+    int keep = num < populationsize ? num : populationsize;
+    std::sort(order, order+keep, [&](int a, int b) {
+	return ranks[a] != ranks[b] ? ranks[a] < ranks[b] : costs[a*m] < costs[b*m]; });
+    for (int i = 0; i < keep; i++) {
+      int member = order[i];
+      memcpy(&newVectors[i*d], &vectors[member*d], d*sizeof(double));
+      memcpy(&newCosts[i*m], &costs[member*m], m*sizeof(double));
+      newRanks[i] = ranks[member];
+      newCrowding[i] = crowding[member];
+    }
+    std::swap(vectors, newVectors);
+    std::swap(costs, newCosts);
+    std::swap(ranks, newRanks);
+    std::swap(crowding, newCrowding);
+    frontSize = 0;
+    while (frontSize < keep && ranks[frontSize] == 0) frontSize++;
+  }
+
+  int NSGA2::tournament(Philox &rng)
+  {
+    int a = rng.randBounded(populationsize);
+    int b = rng.randBounded(populationsize);
+    if (ranks[a] != ranks[b]) return ranks[a] < ranks[b] ? a : b;
+    return crowding[a] >= crowding[b] ? a : b;
+  }
+
+  double NSGA2::evolve()
+  {
+    for (int k = 0; k < populationsize; k++) {
+      int child = populationsize+k;
+      Philox stream(seed, k, generation, EVOLVE_STREAM);
+      parents[0] = &vectors[tournament(stream)*d];
+      distinctRandom(permuter, populationsize, numParents-1, stream);
+      for (int t = 1; t < numParents; t++) {
+	parents[t] = &vectors[permuter[t-1]*d];
+      }
+      recombinator->recombine(&vectors[child*d], parents, stream);
+      evaluate(child);
+    }
+    select(2*populationsize);
+    generation++;
+    return costs[0];
+  }
+
+  double *NSGA2::best()
+  {
+    // The front comes first, ordered by objective 0
+    return vectors;
+  }
+
+  double NSGA2::averageCost()
+  {
+    double sum = 0;
+    for (int member = 0; member < populationsize; member++) {
+      sum += costs[member*m];
+    }
+    return sum/populationsize;
+  }
+
+  int NSGA2::getFrontSize()
+  {
+    return frontSize;
+  }
+
+  double *NSGA2::getFrontVector(int i)
+  {
+    return &vectors[i*d];
+  }
+
+  double const *NSGA2::getFrontCosts(int i)
+  {
+    return &costs[i*m];
+  }
+
+  void NSGA2::printStatistics()
+  {
+    printf("front of %d:", frontSize);
+    for (int k = 0; k < m; k++) {
+      double lo = DBL_MAX, hi = -DBL_MAX;
+      for (int i = 0; i < frontSize; i++) {
+	lo = std::min(lo, costs[i*m+k]);
+	hi = std::max(hi, costs[i*m+k]);
+      }
+      printf(" objective %d in [%g, %g]", k, lo, hi);
+    }
+    printf("\n");
   }
 
   // Differential Evolution recombinator
   DERecombinator::DERecombinator(double cr, double c) {
     this->c = c;
     this->cr = cr;
+    this->logcr = (cr > 0 && cr < 1) ? 1.0/log(cr) : 0;
   }
 
   void DERecombinator::setNumDimensions(int numDimensions) {
@@ -419,19 +2431,25 @@ namespace Opti {
     return 4; // target, parent1+(parent2-parent3)
   }
 
-  void DERecombinator::recombine(double *dest, double const *const *parents) {
+  void DERecombinator::recombine(double *dest, double const *const *parents, Philox &rng) {
     // Start at a random parameter
-    int pos = rng.randInt(d-1);
-    for (int count = 0; count < d;) {
+    int pos = rng.randBounded(d);
+    // Number of parameters taken from the mutant. Each parameter after the
+    // first is taken with probability cr, until the first one that is not,
+    // so the number is 1 + a geometrically distributed number of successes.
+    int length = d;
+    if (cr < 1) {
+      double lengthMinusOne = log(rng.randDblExc())*logcr;
+      if (lengthMinusOne < d-1) length = 1 + (int)lengthMinusOne;
+    }
+    int count = 0;
+    for (; count < length; count++) {
       dest[pos] = parents[1][pos] + c*(parents[2][pos] - parents[3][pos]);
       if (++pos >= d) pos = 0;
-      count++;
-      if (rng.randExc() > cr) {
-	for (;count < d; count++) {
-	  dest[pos] = parents[0][pos];
-	  if (++pos >= d) pos = 0;
-	}
-      }
+    }
+    for (; count < d; count++) {
+      dest[pos] = parents[0][pos];
+      if (++pos >= d) pos = 0;
     }
   };
 
@@ -5,14 +5,41 @@
 // EVOLUTIONARY ALGORITHMS FOR THE OPTIMIZATION OF MULTIPLE REAL VARIABLES
 // by minimization of an arbitrary function of those variables. Global minimum
 // (perfect solution) cannot be guaranteed, but might be reached. The used 
-// algorithms are outlined in [1] (DE) and [2] (G3PCX). G3PCX is a bit buggy
-// and may sometimes give nans in the parameter vector.
+// algorithms are outlined in [1] (DE) and [2] (G3PCX).
 // 
 // Written in 2002-2003 by Olli Niemitalo (o@iki.fi) and Magnus Jonsson,
 // and in 2019 by Olli Niemitalo.
 // This work is placed in the public domain / released under CC0.
 //
 // Version history:
+// v1.2, 2026-10-18
+//      * Random numbers are drawn from counter-based Philox streams keyed by
+//        (seed, individual, generation) and passed explicitly to shuffles and
+//        recombinators, making runs reproducible from their seed
+//      * DE picks parents without shuffle state carried between trials
+//      * Bulk random number generation; DE samples its cross-over length
+//        from a geometric distribution, PCX uses both Box-Muller deviates,
+//        initial and seeded populations are drawn in bulk and G3 shuffles
+//        with unbiased bounded integers
+//      * Strategy::run with evaluation, time, target and stagnation limits
+//      * Optional surrogate model pre-screening of DE trial vectors
+//      * Hardware performance counter profiling of evolution phases
+//      * Generational DE with batched evaluation of the trial vectors
+//      * ParameterMap and ReducedProblem for searching only free parameters
+//      * FixedDE, a DE with compile-time problem, recombinator and dimension
+//      * Parallel G3 with disjoint families evaluated on a thread pool
+//      * Fixed the nans of PCX and rejected non-finite offspring in G3
+//      * Memory-mapped on-disk Archive of best solutions per configuration
+//      * Multi-objective problems and the NSGA2 strategy
+//      * Progress callback and cancellation in RunLimits
+//      * Problem::activePieces, the Minimax strategy and DE::inject
+//      * Restarts, a meta-strategy restarting collapsed or stagnant runs
+//        with growing populations
+//      * EvaluationCache of quantized trial vectors for DE
+//      * Publication of the best solution in shared memory, and an
+//        improvement callback in RunLimits
+//      * Continuation, a meta-strategy ramping the problem from an easy one
+//        to the target, and DE::rescore
 // v1.1, 2019-06-05
 //      * Removed experimental optimizer GreedyMagnus and its recombinator
 //      * Increased precision in parameter vector printout
@@ -27,22 +54,98 @@
 // [2] Deb, K , Anand, A., and Joshi, D (April, 2002). 
 // A Computationally Efficient Evolutionary Algorithm for Real-Parameter 
 // Optimization. KanGAL Report No. 2002003.
+//
+// [3] Deb, K., Pratap, A., Agarwal, S., and Meyarivan, T. (2002). A Fast
+// and Elitist Multiobjective Genetic Algorithm: NSGA-II. IEEE Transactions
+// on Evolutionary Computation, 6(2), 182-197.
+//
+// [4] Auger, A. and Hansen, N. (2005). A Restart CMA Evolution Strategy
+// With Increasing Population Size. IEEE Congress on Evolutionary
+// Computation, 1769-1776.
+//
+// [5] Hansen, N. (2009). Benchmarking a BI-Population CMA-ES on the
+// BBOB-2009 Function Testbed. GECCO Workshop on Black-Box Optimization
+// Benchmarking, 2389-2396.
 
 #include "MersenneTwister.h"
+#include "philox.hpp"
+#include <float.h>
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 namespace Opti {
 
-  // Mersenne twister random generator
+  // Mersenne twister random generator. Only used for drawing default seeds;
+  // the algorithms draw from Philox streams given to them explicitly.
   extern MTRand rng;
+
+  // Draw a seed from rng
+  uint64_t randomSeed();
     
   // Perform Fisher-Yates shuffle 
-  void shuffle(int *table, int num);
+  void shuffle(int *table, int num, Philox &rng);
         
   // Perform partial Fisher-Yates shuffle 
   // Only first numshuffle entries in the table are shuffled properly with the rest of the table
-  void partialShuffle(int *table, int numtotal, int numshuffle);
+  void partialShuffle(int *table, int numtotal, int numshuffle, Philox &rng);
+
+  // Draw num distinct integers in [0, numtotal-1] into table. Unlike
+  // partialShuffle, needs no state other than the random stream.
+  void distinctRandom(int *table, int numtotal, int num, Philox &rng);
 
         
+  // Return true if x is neither infinite nor NaN. Tests the exponent bits,
+  // so it also works with -ffast-math, under which x == x is always true.
+  inline bool isFinite(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+  }
+
+  // Return true if all num elements of vector are finite
+  inline bool isFinite(double const *vector, int num) {
+    for (int i = 0; i < num; i++) {
+      if (!isFinite(vector[i])) return false;
+    }
+    return true;
+  }
+
+  // Fixed set of threads for running parallel loops
+  class ThreadPool {
+  public:
+    // numThreads = Number of threads including the calling thread,
+    // or 0 for one per hardware thread
+    ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    int getNumThreads();
+
+    // Call function(i) for i = 0..num-1, spread over the threads and the
+    // calling thread. Returns when all calls have returned.
+    void parallelFor(int num, std::function<void(int)> const &function);
+
+  private:
+    void work();
+    void runJob();
+
+    int numWorkers;                  // Threads besides the calling thread
+    std::thread *workers;
+    std::mutex mutex;
+    std::condition_variable started; // A job was posted or quit was set
+    std::condition_variable finished;
+    std::function<void(int)> const *job;
+    int jobSize;
+    std::atomic<int> next;           // Next index of the job to run
+    int running;                     // Workers still in the job
+    unsigned long jobNumber;
+    bool quit;
+  };
+
   // Compute square of the perpendicular (that is, shortest) distance from 
   // a point (point) to a line in a multidimensional space. The line is 
   // defined as pointonline+a*linedirection where a is a scalar and 
@@ -88,18 +191,154 @@ namespace Opti {
     // 
     // Must be implemented in the actual optimization problem.
     virtual double costFunction(double *params, double compare)=0; 
+
+    // Evaluate costs[i] = costFunction(params[i], compare[i]) for num
+    // parameter vectors. Problems can override this to evaluate the vectors
+    // together, for example to reuse cached data between them.
+    virtual void costFunctionBatch(double **params, double const *compare, double *costs, int num);
+
+    // Number of objectives for multi-objective strategies. 1 by default.
+    virtual int getNumObjectives();
+
+    // Write the getNumObjectives() costs of params to costs, all of which
+    // are minimized. By default the single cost is costFunction without
+    // early-out. Like costFunction, this may modify params.
+    virtual void costVector(double *params, double *costs);
+
+    // For costs that are the maximum of smooth pieces, such as the max abs
+    // error over samples: write the values of up to maxPieces pieces within
+    // tolerance of the cost at params to values[], largest first, and their
+    // gradients with respect to params to gradients[], getNumDimensions()
+    // per piece. Returns the number of pieces, or 0 if not available, which
+    // is the default.
+    virtual int activePieces(double *params, double tolerance, double *values, double *gradients, int maxPieces);
 		
     // Print parameter vector to stdout.
     virtual void print(double *params);
   };
     
 	
+  // Declarative mapping from the free parameters seen by a strategy to the
+  // full parameter vector of a problem. A full parameter is either free or
+  // tied to (equal to) a free parameter. Free parameters can be constrained
+  // to a sign and clamped to bounds.
+  class ParameterMap {
+  public:
+    // numFull = Number of parameters in the full vector, all initially free
+    ParameterMap(int numFull);
+    ~ParameterMap();
+
+    // Make param equal to the free parameter source
+    void tie(int param, int source);
+
+    // Make param positive (sign = 1) or negative (sign = -1)
+    void constrainSign(int param, int sign);
+
+    // Clamp param to [min, max]
+    void clamp(int param, double min, double max);
+
+    int getNumFull();
+    int getNumFree();
+
+    // Apply the constraints to the free parameters and expand them into
+    // the full parameter vector
+    void expand(double *free, double *full);
+
+    // Take the free parameters from a full parameter vector
+    void reduce(double const *full, double *free);
+
+  private:
+    int numFull;
+    int *source;     // Free parameter of each full parameter (itself if free)
+    int *sign;       // Sign constraint of each full parameter, or 0
+    double *min;     // Bounds of each full parameter
+    double *max;
+  };
+
+  // Stopping criteria for Strategy::run. A run stops when any of the
+  // enabled criteria is met. Zero disables a criterion.
+  struct RunLimits {
+    long long maxEvaluations;       // Cost function evaluations
+    double maxSeconds;              // Wall-clock time
+    double targetCost;              // Stop when best cost <= targetCost (disabled by default)
+    long long stagnationWindow;     // Evaluations without improvement of best cost
+    long long reportInterval;       // Print progress every this many calls to evolve
+
+    // If set, called at progress reports instead of printing, with the
+    // evaluations of the run so far and the best cost. Returning false
+    // stops the run with STOP_CANCELLED.
+    bool (*progress)(void *context, long long evaluations, double bestcost);
+    void *progressContext;
+
+    // If set, called whenever the best cost improves, with the best
+    // vector, its cost and the evaluations of the run so far
+    void (*improved)(void *context, double const *best, double cost, long long evaluations);
+    void *improvedContext;
+
+    RunLimits();
+  };
+
+  // Why a run stopped
+  enum StopReason {
+    STOP_EVALUATIONS,
+    STOP_TIME,
+    STOP_TARGET,
+    STOP_STAGNATION,
+    STOP_CANCELLED
+  };
+
+  // Result of Strategy::run
+  struct RunResult {
+    double *best;           // Best parameter vector, owned by the strategy
+    double cost;            // Cost of best
+    long long evaluations;  // Cost function evaluations during the run
+    double seconds;         // Wall-clock time of the run
+    StopReason reason;
+  };
+
+  // A problem exposing only the free parameters of another problem, as
+  // given by a ParameterMap. The strategy searches a space of smaller
+  // dimension, and the cost function expands the free parameters to the
+  // full vector before calling the underlying cost function.
+  class ReducedProblem : public Problem {
+  public:
+    // The problem and map are not deleted by ReducedProblem
+    ReducedProblem(Problem *problem, ParameterMap *map);
+    ~ReducedProblem();
+
+    int getNumDimensions();
+    double *getMin();
+    double *getMax();
+    double costFunction(double *params, double compare);
+    void costFunctionBatch(double **params, double const *compare, double *costs, int num);
+    void print(double *params);
+
+    // Expand free parameters into a full parameter vector of the problem
+    void expand(double *params, double *full);
+
+  private:
+    Problem *problem;
+    ParameterMap *map;
+    double *min;
+    double *max;
+  };
+
   // Optimization algorithm base class. Inherited by the actual optimization
   // algorithms (implemented later in this file).
   class Strategy {
   public:
+    // Constructor
+    Strategy();
+
     // Destructor
     virtual ~Strategy();
+
+    // Evolve until one of the limits is met. The strategy can be run again
+    // to continue.
+    RunResult run(RunLimits const &limits);
+
+    // Return number of cost function evaluations so far
+    long long evaluations();
 		
     // Return best parameter vector so far
     virtual double *best()=0;
@@ -109,9 +348,192 @@ namespace Opti {
 		
     // Evolve some...
     virtual double evolve()=0;
+
+    // Print statistics other than costs to stdout, such as those of
+    // profiling or pre-screening. Called after progress reports.
+    virtual void printStatistics();
+
+  protected:
+    long long numEvaluations; // Incremented by the actual algorithms
   };
 	
     
+  // Hardware performance counter profiler using Linux perf_event_open.
+  // Counts cycles, instructions, L1 data cache read misses, last level
+  // cache read misses and branch misses in user space, and attributes them
+  // to the phases of an evolution step. The counters are read as one group
+  // at each phase change. L2 misses have no generic perf event, so the last
+  // level cache stands in for them. Counters the host does not support are
+  // left out; if none are, the profiler is unavailable and does nothing.
+  class Profiler {
+  public:
+    enum Phase {
+      RECOMBINATION,
+      EVALUATION,
+      BOOKKEEPING,
+      NUM_PHASES
+    };
+    enum Counter {
+      CYCLES,
+      INSTRUCTIONS,
+      L1D_MISSES,
+      LL_MISSES,
+      BRANCH_MISSES,
+      NUM_COUNTERS
+    };
+
+    Profiler();
+    ~Profiler();
+
+    bool available();
+
+    // End the current phase, if any, and start counting for phase
+    void enter(Phase phase);
+
+    // End the current phase
+    void stop();
+
+    // Print counts per evaluation for each phase. Evaluations are counted
+    // as entries to the EVALUATION phase.
+    void print();
+
+  private:
+    // Read the group into values. Returns false on a failed or short read.
+    bool read(long long *values);
+
+    int fds[NUM_COUNTERS];   // File descriptors, -1 for unsupported counters
+    int order[NUM_COUNTERS]; // Position of each counter in the group read
+    int numOpen;
+    int current;             // Current phase or -1
+    long long numEvaluations;
+    long long last[NUM_COUNTERS];
+    long long totals[NUM_PHASES][NUM_COUNTERS];
+  };
+
+  // On-disk archive of the best solutions found for different problem
+  // configurations. Each configuration is identified by a key vector of
+  // numKeys numbers, for example logarithms of the problem's settings, and
+  // has one entry: the best parameter vector stored for it, its cost and
+  // the run that found it. The file is memory mapped, so lookups are cheap
+  // and need no parsing. It is locked exclusively while being written and
+  // shared while being read, so that concurrent runs can share it, and the
+  // fields of entries are copied out under the lock. Linux/POSIX only;
+  // elsewhere the archive never opens.
+  class Archive {
+  public:
+    // Open fileName, creating it if it does not exist. The file must have
+    // been created with the same numParams and numKeys. A NULL fileName
+    // gives an archive that is not open.
+    Archive(char const *fileName, int numParams, int numKeys);
+    ~Archive();
+
+    bool isOpen();
+    int getNumEntries();
+
+    // Copy the key and the parameters of entry to key[] and params[],
+    // either of which may be NULL, and return its cost. The other getters
+    // also copy the whole entry, so none sees a half-written one.
+    double getEntry(int entry, double *key, double *params);
+    double getCost(int entry);
+    long long getEvaluations(int entry);
+    double getSeconds(int entry);
+    uint64_t getSeed(int entry);
+    long long getTime(int entry);  // Unix time of storing
+
+    // Return the entry with exactly the given key, or -1
+    int find(double const *key);
+
+    // Write to entries[] up to num entries nearest to key in Euclidean
+    // distance, nearest first. Returns the number written.
+    int nearest(double const *key, int *entries, int num);
+
+    // Store params as the entry of key if the key is new or cost is lower
+    // than the stored cost. Returns true if stored.
+    bool store(double const *key, double const *params, double cost, long long evaluations, double seconds, uint64_t seed);
+
+  private:
+    struct Header {
+      char magic[8];
+      uint32_t numParams;
+      uint32_t numKeys;
+      uint64_t numEntries;
+      uint64_t capacity;
+    };
+
+    // Map the whole file if another process has grown it
+    bool refresh();
+    // Number of entries after refresh, or -1 if the header does not fit
+    // the file. Call with the file locked.
+    int validEntries();
+    // Copy the fields of entry to fields[] under a shared lock
+    bool copyEntry(int entry, double *fields);
+    // find with the file locked
+    int findLocked(double const *key, int numEntries);
+    // Grow the file and the mapping to hold capacity entries
+    bool grow(uint64_t capacity);
+    double *entry(int entry);
+
+    int fd;
+    char *base;     // Mapped file, NULL if not open
+    size_t size;    // Mapped bytes
+    int numParams;
+    int numKeys;
+    int stride;     // Doubles per entry
+    double *fields; // Copy of an entry
+  };
+
+  // Live publication of the best solution of a running optimization in a
+  // named POSIX shared memory segment, for other processes on the same
+  // host to read without I/O or parsing. There is one writer and any
+  // number of readers, and neither blocks the other. The segment is a
+  // header followed by numParams 64-bit words holding the bits of the
+  // parameters. The cost, evaluations, time and parameter words are
+  // written and read as relaxed atomics inside a seqlock: the writer makes
+  // the sequence word odd before writing and even again after, and a
+  // reader retries until it sees the same even sequence before and after
+  // copying. The version of a publication is its sequence divided by 2.
+  // Linux/POSIX only; elsewhere the publication never opens.
+  class Publication {
+  public:
+    // As writer, create the segment name, e.g. "/norm_5x5", or take over
+    // an existing one, continuing its versions if it has the same
+    // numParams. As reader, open an existing segment; numParams 0 accepts
+    // any. A NULL name gives a publication that is not open.
+    Publication(char const *name, int numParams, bool writer);
+    ~Publication();
+
+    bool isOpen();
+    int getNumParams();
+
+    // Writer: publish params with their cost and the evaluations so far
+    void publish(double const *params, double cost, long long evaluations);
+
+    // Reader: copy the latest publication to params, cost, evaluations and
+    // time (Unix time of publishing) and return its version. Returns 0 if
+    // nothing has been published or the writer stopped in mid-write.
+    uint64_t read(double *params, double &cost, long long &evaluations, long long &time);
+
+    // Remove the segment name. Open publications stay valid.
+    static bool remove(char const *name);
+
+  private:
+    struct Header {
+      char magic[8];
+      uint32_t numParams;
+      uint32_t reserved;
+      std::atomic<uint64_t> sequence;
+      std::atomic<uint64_t> cost;         // Bits of a double
+      std::atomic<uint64_t> evaluations;
+      std::atomic<uint64_t> time;
+    };
+
+    Header *header;                 // Mapped segment, NULL if not open
+    std::atomic<uint64_t> *words;   // Parameters, following the header
+    size_t size;                    // Mapped bytes
+    int numParams;
+    bool writer;
+  };
+
   // Recombinator operator base class. Used in evolutionary algorithms.
   // This is almost like sex! :-)
   class Recombinator {
@@ -120,9 +542,10 @@ namespace Opti {
     virtual void setNumDimensions(int numDimensions) = 0;
     // 2: Strategy asks: How many parents does this recombinator require?
     virtual int numParents() = 0;
-    // 3: Strategy uses recombinator to make offspring from parents.
-    // (dest being one of the parents causes undefined behaviour)
-    virtual void recombine(double *dest, double const *const *parents) = 0;
+    // 3: Strategy uses recombinator to make offspring from parents, drawing
+    // random numbers from rng. (dest being one of the parents causes
+    // undefined behaviour)
+    virtual void recombine(double *dest, double const *const *parents, Philox &rng) = 0;
     // 4: Strategy destroys its recombinator.
     virtual ~Recombinator();
   };
@@ -140,7 +563,7 @@ namespace Opti {
     PCXRecombinator(int numparents=3, double sd1 = 0.1, double sd2 = 0.1);
     ~PCXRecombinator();
     int numParents();
-    void recombine(double *dest, double const *const *parents);
+    void recombine(double *dest, double const *const *parents, Philox &rng);
   };
 	
     
@@ -148,13 +571,32 @@ namespace Opti {
   class G3 : public Strategy
   {
   public:
-    G3(Problem *problem, int populationsize, Recombinator *recombinator = new PCXRecombinator(), int numOffspring=2);
+    G3(Problem *problem, int populationsize, Recombinator *recombinator = new PCXRecombinator(), int numOffspring=2, uint64_t seed = randomSeed());
     ~G3();
 
     double *best();
     double averageCost();
     double evolve();
+    void printStatistics();
+
+    // Attribute hardware counts to the phases of evolve, or pass NULL to
+    // stop profiling. The profiler is not deleted by G3.
+    void setProfiler(Profiler *profiler);
+
+    // Replace members first..first+num-1 with random ones within the ranges
+    // minx[] and maxx[], for example near a known good solution. The best
+    // member is moved to the front. first >= 1 keeps the current best.
+    void seedPopulation(double *minx, double *maxx, int num, int first = 1);
+
+    // Run numFamilies disjoint families per call to evolve, each with its
+    // own parents and replacement candidates, and evaluate the offspring
+    // of all families in parallel on the thread pool. The result does not
+    // depend on the number of threads. Pass NULL to evolve serially. The
+    // pool is not deleted by G3.
+    void setParallel(ThreadPool *pool, int numFamilies);
   private:
+    double evolveFamilies();
+
     class Individual
     {
     public:
@@ -181,17 +623,153 @@ namespace Opti {
     double **parentList;
 		
     Recombinator *recombinator;
+    Profiler *profiler;
+
+    ThreadPool *pool;          // Pool for parallel evaluation, or NULL
+    int numFamilies;
+    Individual *offsprings;    // Offspring of all families
+    double *compares;          // Costs the offspring compete against
+    double **familyParents;    // Parent lists of all families
+
+    uint64_t seed;       // Key of the random streams
+    uint32_t iteration;  // Number of calls to evolve, numbers the streams
+    uint32_t seedings;   // Number of calls to seedPopulation
   };
     
+  // Surrogate model for pre-screening trial vectors before evaluation.
+  // Predicts the cost of a vector by inverse distance weighting of its k
+  // nearest neighbours among the most recently evaluated vectors. A trial
+  // predicted to cost more than compare by a relative margin is skipped.
+  // A fraction of the would-be-skipped trials are evaluated anyway to track
+  // how often the model rejects an improvement, and the model turns itself
+  // off while that happens too often. While off, all trials are evaluated
+  // and checked against the predictions, so the model can turn on again.
+  class Surrogate {
+  public:
+    // capacity           = Number of recent evaluations kept
+    // k                  = Number of neighbours in a prediction
+    // margin             = Relative margin by which the prediction must exceed compare
+    // auditRate          = Fraction of would-be-skipped trials evaluated anyway
+    // maxFalseRejections = Tolerated fraction of audited trials that improved
+    Surrogate(int capacity = 256, int k = 8, double margin = 0.05, double auditRate = 0.1, double maxFalseRejections = 0.02);
+    ~Surrogate();
+
+    void setNumDimensions(int numDimensions);
+
+    // Return true if the trial vector should not be evaluated. compare is
+    // the cost the trial competes against. wouldSkip is set to the
+    // prediction, also for audited trials.
+    bool skip(double const *vector, double compare, Philox &rng, bool &wouldSkip);
+
+    // Report the cost of an evaluated vector and the wouldSkip that skip
+    // gave for it. A cost of at least compare is only a bound from an
+    // early-out, so it is audited but not kept for predictions.
+    void evaluated(double const *vector, double cost, double compare, bool wouldSkip);
+
+    // Forget the evaluations, for example after the problem has changed
+    void clear();
+
+    // Print screening statistics to stdout
+    void print();
+
+    long long screened;        // Calls to skip
+    long long skipped;         // Trials skipped
+    long long audits;          // Would-be-skipped trials evaluated
+    long long falseRejections; // Audited trials that improved on compare
+  private:
+    double predict(double const *vector);
+
+    int d;
+    int capacity, k;
+    double margin, auditRate, maxFalseRejections;
+    double *vectors;    // Ring buffer of evaluated vectors
+    double *costs;      // and their costs
+    int num;            // Number of vectors in the ring buffer
+    int next;           // Where the next vector goes
+    bool enabled;
+    double falseRejectionRate; // Moving average over audits
+    double *nearestDistances;  // Temporary tables for the k nearest
+    double *nearestCosts;
+  };
+
+  // Cache of recent evaluations, keyed by the parameter vector with the low
+  // dropBits bits of each mantissa cleared, so that vectors equal to within
+  // a relative 2^(dropBits-52) share an entry. An entry holds the cost, or
+  // a lower bound of it if the evaluation stopped early. Direct-mapped by a
+  // hash of the key: a new entry replaces whatever was in its slot.
+  class EvaluationCache {
+  public:
+    // capacity = Number of entries, rounded up to a power of two
+    EvaluationCache(int capacity = 4096, int dropBits = 8);
+    ~EvaluationCache();
+
+    void setNumDimensions(int numDimensions);
+
+    // Compute the key of vector into key[], numDimensions words. Return
+    // true if the cost of vector against compare is known: the cached
+    // cost, or compare if the cost is known to be at least compare. In the
+    // first case, vector is replaced by the cached vector as it was after
+    // evaluation, because the cost function may modify its argument.
+    bool lookup(double *vector, double compare, double &cost, uint64_t *key);
+
+    // Store vector, after its evaluation against compare, with its cost
+    // under key. A cost of at least compare is stored as a lower bound.
+    void store(uint64_t const *key, double const *vector, double cost, double compare);
+
+    // Forget all entries, for example after the problem has changed
+    void clear();
+
+    // Print hit statistics to stdout
+    void print();
+
+    long long lookups;    // Calls to lookup
+    long long hits;       // Lookups that found the cost
+    long long boundHits;  // Lookups that found a lower bound >= compare
+  private:
+    int slot(uint64_t const *key);
+
+    int d;
+    int capacity;
+    uint64_t mask;      // Clears the dropped bits
+    uint64_t *keys;     // Key of each entry
+    double *vectors;    // Evaluated vector of each entry
+    double *costs;      // Cost of each entry, or its lower bound
+    bool *exact;        // The cost is exact, not a lower bound
+    bool *used;
+  };
+
   // Differential Evolution recombinator
   class DERecombinator : public Recombinator{
   private:
     int d;
     double cr, c;
+    double logcr; // 1/log(cr), for sampling the cross-over length
   public:    
     void setNumDimensions(int numDimensions);
     int numParents();
-    void recombine(double *dest, double const *const *parents);
+    void recombine(double *dest, double const *const *parents, Philox &rng);
+
+    // Number of parents, for strategies that need it at compile time
+    enum { NUM_PARENTS = 4 };
+
+    // Same as recombine, with the number of dimensions D known at compile
+    // time. The parameters are selected without branches, so the loop can
+    // be unrolled and vectorized.
+    template <int D>
+    void recombineFixed(double *dest, double const *const *parents, Philox &rng) {
+      int pos = rng.randBounded(D);
+      int length = D;
+      if (cr < 1) {
+	double lengthMinusOne = log(rng.randDblExc())*logcr;
+	if (lengthMinusOne < D-1) length = 1 + (int)lengthMinusOne;
+      }
+      for (int i = 0; i < D; i++) {
+	int k = i - pos;
+	if (k < 0) k += D;
+	double mutant = parents[1][i] + c*(parents[2][i] - parents[3][i]);
+	dest[i] = (k < length) ? mutant : parents[0][i];
+      }
+    }
 
     // Constructor
     // cr = Cross-over amount. 0 is unreasonable.
@@ -231,9 +809,47 @@ namespace Opti {
     // minx[] = parameter vector with all parameters set to minimum possible values
     // maxx[] = parameter vector with all parameters set to maximum possible values
     void randomPopulation(double *minx, double *maxx);
+
+    // Fill parameters in population members first..first+num-1 with random
+    // values and evaluate them. Used for seeding part of the population
+    // near a known good solution, given by the ranges minx[] and maxx[].
+    void seedPopulation(double *minx, double *maxx, int num, int first = 0);
 		
     void statistics();
 
+    // Pre-screen trials with the surrogate model, or pass NULL to evaluate
+    // all trials. The surrogate is not deleted by DE.
+    void setSurrogate(Surrogate *surrogate);
+
+    // Look up trials in the cache before evaluating them, or pass NULL to
+    // evaluate all trials. Trials found in the cache count as evaluations.
+    // The cache is not deleted by DE.
+    void setCache(EvaluationCache *cache);
+
+    // Attribute hardware counts to the phases of evolve, or pass NULL to
+    // stop profiling. The profiler is not deleted by DE.
+    void setProfiler(Profiler *profiler);
+
+    // Print pre-screening and profiling statistics
+    void printStatistics();
+
+    // Replace the worst population member with vector of the given cost,
+    // for example one improved by a local method
+    void inject(double const *vector, double cost);
+
+    // Evaluate the whole population again, after the problem has changed,
+    // and forget the evaluations in the cache and the surrogate. If pool is
+    // given, the population is split into batches of
+    // Problem::costFunctionBatch evaluated on it, so the problem must allow
+    // concurrent calls and must not use the pool itself. Returns the best
+    // cost.
+    double rescore(ThreadPool *pool = NULL);
+
+    // If on, each call to evolve makes a trial for every population member
+    // from the population as it was at the start of the generation, and
+    // evaluates the trials together with Problem::costFunctionBatch.
+    void setGenerational(bool generational);
+
     // Evolve into next generation - try evolve(&z, 0, 0.7, 1.0, 1);
     //
     // z            = Pointer to cost function to minimize (argument: parameter vector) 
@@ -248,10 +864,10 @@ namespace Opti {
 		
     double evolve();
 		
-    void init(Problem *problem, int np, Recombinator *recombinator);
-
     // Constructor
-    DE(Problem *problem, int np, Recombinator *recombinator);
+    // The random streams are keyed by seed and numbered by individual and
+    // generation, so runs with the same seed give identical results.
+    DE(Problem *problem, int np, Recombinator *recombinator, uint64_t seed = randomSeed());
 		
     // Destructor
     ~DE();
@@ -266,13 +882,443 @@ namespace Opti {
     double *_best;        // Pointer to best parameter vector in population
     double bestcost;     // Cost of the above (invalid if best == NULL)
     double sumcost;      // sum of all costs in population, for calculation of average cost
-    int *permuter;  // Shuffled parent table
+    int *permuter;  // Table of random parent indices
     Problem *problem;
     Recombinator *recombinator;
     double **parents; // Temporary parents table for recombinator
     double *trialvector; // Temporary trial vector
+    bool generational;   // Evolve a whole generation at a time
+    double *trialvectors; // Trial vectors of a generation, or NULL
+    double **trialpointers;
+    double *trialcosts;
+    double *comparecosts;
+    bool *wouldskips;     // Surrogate predictions of the evaluated trials
+    double evolveGeneration();
+    Surrogate *surrogate; // Pre-screening model or NULL
+    EvaluationCache *cache; // Cache of evaluations or NULL
+    uint64_t *cachekeys;  // Keys of the trials, np*d
+    Profiler *profiler;   // Hardware counter profiler or NULL
+    uint64_t seed;       // Key of the random streams
+    uint32_t generation; // Number of completed generations
+    uint32_t seedings;   // Number of calls to seedPopulation
   };
     	    
+  // Multi-objective evolution in the manner of NSGA-II [3]. Each generation
+  // makes populationsize offspring, each from a parent chosen by binary
+  // tournament and the other parents of the recombinator drawn at random,
+  // as in DE. Parents and offspring together are sorted into fronts of
+  // non-dominated members, and the next population is filled front by front,
+  // the last front by largest crowding distance. The first front approximates
+  // the Pareto front of the problem's objectives. The Strategy interface
+  // reports objective 0.
+  class NSGA2 : public Strategy
+  {
+  public:
+    // The recombinator is not deleted by NSGA2
+    NSGA2(Problem *problem, int populationsize, Recombinator *recombinator, uint64_t seed = randomSeed());
+    ~NSGA2();
+
+    double *best();        // Member with the lowest objective 0
+    double averageCost();  // Average of objective 0
+    double evolve();       // Evolve a generation, return lowest objective 0
+
+    // As in DE
+    void seedPopulation(double *minx, double *maxx, int num, int first = 0);
+
+    // Non-dominated members of the population, by ascending objective 0
+    int getFrontSize();
+    double *getFrontVector(int i);
+    double const *getFrontCosts(int i);
+
+    // Print the size and objective ranges of the front
+    void printStatistics();
+
+  private:
+    // Rank and crowding distance of members 0..num-1, then keep the best
+    // populationsize of them in 0..populationsize-1, ordered by rank and
+    // objective 0
+    void select(int num);
+    void evaluate(int member);
+    // Index of the winner of a binary tournament
+    int tournament(Philox &rng);
+
+    Problem *problem;
+    Recombinator *recombinator;
+    int d;                // Number of parameters
+    int m;                // Number of objectives
+    int populationsize;
+    int numParents;
+    double *vectors;      // Parameter vectors of population and offspring
+    double *costs;        // Their objectives, m per member
+    int *ranks;           // Front numbers, 0 for the non-dominated
+    double *crowding;     // Crowding distances
+    int *order;           // Temporary tables for select
+    int *remaining;
+    double *newVectors;
+    double *newCosts;
+    int *newRanks;
+    double *newCrowding;
+    int frontSize;
+    double **parents;     // Parents table for the recombinator
+    int *permuter;        // Random parent indices
+    uint64_t seed;        // Key of the random streams
+    uint32_t generation;  // Number of completed generations
+    uint32_t seedings;    // Number of calls to seedPopulation
+  };
+
+  // Proximal bundle method for minimax costs, using the pieces and
+  // gradients of Problem::activePieces. Each step linearizes the pieces
+  // within tolerance of the cost at the current point and moves to the
+  // minimizer of the maximum of the linearizations plus |d|^2/(2 mu). The
+  // dual of this subproblem, a concave quadratic over weights of the pieces
+  // on the simplex, is solved by Frank-Wolfe iteration. Steps that decrease
+  // the cost are taken and grow mu; others shrink it. Converges fast in the
+  // basin of a local minimum, so it refines solutions of global strategies.
+  class Minimax : public Strategy
+  {
+  public:
+    // start = initial parameter vector
+    // tolerance = pieces within tolerance*cost of the cost are active
+    Minimax(Problem *problem, double const *start, int maxPieces = 64, double tolerance = 0.1, double mu = 1e-4);
+    ~Minimax();
+
+    double *best();
+    double averageCost();  // Cost of the current point
+    double evolve();       // Take a step
+
+    // Take numSteps steps from params, improving it in place, and return
+    // its cost. Uses the step size state of this strategy.
+    double refine(double *params, int numSteps);
+
+    // Print the step size and step statistics
+    void printStatistics();
+
+  private:
+    double step(double *params, double cost);
+
+    Problem *problem;
+    int d;
+    int maxPieces;
+    double tolerance;
+    double mu;            // Proximal step size
+    double *point;        // Current point
+    double cost;          // Its cost
+    double *values;       // Active pieces
+    double *gradients;
+    double *lambda;       // Weights of the pieces in the dual
+    double *v;            // Weighted sum of the gradients
+    double *trial;
+    int numPieces;        // Active pieces at the last step
+    long long accepted;
+    long long rejected;
+  };
+
+  // Creates a strategy of the given population size and random seed for
+  // Restarts. If elite is not NULL, the strategy should include it, of the
+  // given cost, in its population.
+  typedef Strategy *(*StrategyFactory)(void *context, int populationSize, uint64_t seed, double const *elite, double eliteCost);
+
+  // Restarts of a strategy created by a factory. A run is restarted when
+  // its population has collapsed, that is the average cost is within
+  // spreadTolerance (relative) of the best cost, or when neither its best
+  // nor its average cost has improved for stagnationGenerations times the
+  // population size evaluations. The best vector of all runs, the elite, is kept and given
+  // to each new run. In the IPOP regime [4], each restart doubles the
+  // population size. In the BIPOP regime [5], large runs doubling the
+  // population alternate with small runs of population size
+  // base*(large/base)^(u^2), u uniform in [0,1), so that both regimes use
+  // about the same number of evaluations. Population sizes are capped at
+  // maxPopulation.
+  class Restarts : public Strategy
+  {
+  public:
+    enum Regime {
+      IPOP,
+      BIPOP
+    };
+
+    // The result of a finished run
+    struct Record {
+      int populationSize;
+      bool large;            // Run of the large population regime
+      bool collapsed;        // Restarted because of collapse, else stagnation
+      long long evaluations; // Evaluations of the run
+      double cost;           // Best cost of the run
+    };
+
+    // numDimensions = dimension of the vectors of the created strategies
+    // populationSize = population size of the first run
+    Restarts(StrategyFactory factory, void *context, int numDimensions, int populationSize, Regime regime = IPOP, uint64_t seed = randomSeed());
+    ~Restarts();
+
+    // Set the restart criteria, by default 1e-9 and 100
+    void setCriteria(double spreadTolerance, long long stagnationGenerations);
+
+    // Set the largest population size, by default 64 times the first
+    void setMaxPopulation(int maxPopulation);
+
+    double *best();         // The elite
+    double averageCost();   // Of the current run
+    double evolve();        // Evolve the current run, restart if needed
+
+    // The current run
+    Strategy *current();
+
+    int getNumRestarts();
+    Record const &getRecord(int restart);
+
+    // Print the current run, then its statistics and those of the restarts
+    void printStatistics();
+
+    // Print the record of each finished run, then the current run as
+    // "stopped"
+    void printRecords();
+
+  private:
+    void restart(bool collapsed);
+
+    StrategyFactory factory;
+    void *context;
+    int d;
+    Regime regime;
+    uint64_t seed;
+    double spreadTolerance;
+    long long stagnationGenerations;
+    int basePopulation;
+    int maxPopulation;
+    int largePopulation;        // Population size of the latest large run
+    Strategy *strategy;         // Current run
+    int populationSize;         // of the current run
+    bool large;                 // The current run is of the large regime
+    long long runStart;         // numEvaluations at the start of the current run
+    long long pastEvaluations;  // Evaluations of the deleted runs
+    long long lastImprovement;  // numEvaluations at the last improvement of the run
+    long long calls;            // Calls to evolve in the current run
+    double runCost;             // Best cost of the current run
+    double runAverage;          // Lowest average cost of the current run
+    long long largeEvaluations; // Evaluations used by each regime
+    long long smallEvaluations;
+    double *elite;
+    double eliteCost;
+    Record *records;
+    int numRecords;
+    int recordCapacity;
+  };
+
+  // Moves the problem to position in [0, 1] along a path from an easy
+  // problem at 0 to the target problem at 1
+  typedef void (*ContinuationStep)(void *context, double position);
+
+  // Continuation meta-strategy. A hard problem is often solved faster by
+  // solving an easy one first and then moving the problem to the target in
+  // small steps, each starting from the population of the previous one
+  // instead of from scratch. The position advances in numSteps equal steps
+  // of stepEvaluations evaluations each, and the population is rescored
+  // after each move. The costs of the easier problems are not comparable
+  // to those of the target, so evolve returns DBL_MAX until the target is
+  // reached. Note that the stagnation window of Strategy::run includes the
+  // ramp.
+  class Continuation : public Strategy
+  {
+  public:
+    // Moves the problem to position 0 and rescores de, on pool if given
+    // (see DE::rescore). The de is deleted by Continuation.
+    Continuation(DE *de, ContinuationStep step, void *context, int numSteps, long long stepEvaluations, ThreadPool *pool = NULL);
+    ~Continuation();
+
+    double *best();
+    double averageCost();
+    double evolve();
+
+    double getPosition();
+    bool atTarget();
+
+    // Print the statistics of the DE, then the position and the best cost
+    // at it
+    void printStatistics();
+
+  private:
+    DE *de;
+    ContinuationStep step;
+    void *context;
+    int numSteps;
+    long long stepEvaluations;
+    ThreadPool *pool;
+    int stepNumber;       // Current step, numSteps at the target
+    long long stepStart;  // numEvaluations at the start of the step
+    double stepCost;      // Best cost at the current step
+  };
+
+  // Differential Evolution with the problem class P, the recombinator
+  // class R and the number of parameters D known at compile time
+  // ----------------------------------------------------------------------
+  //
+  // The trial vector and the parent table live on the stack, and the cost
+  // function and recombination are called without virtual dispatch so that
+  // the compiler can inline them. R must provide NUM_PARENTS and
+  // recombineFixed<D>, as DERecombinator does. Otherwise works like DE,
+  // drawing from the same random streams, and is used through the
+  // Strategy interface.
+  template <class P, class R, int D>
+  class FixedDE : public Strategy
+  {
+  public:
+    FixedDE(P *problem, int np, R *recombinator, uint64_t seed = randomSeed());
+    ~FixedDE();
+
+    double *best();
+    double averageCost();
+    double evolve();
+
+    // As in DE
+    void seedPopulation(double *minx, double *maxx, int num, int first = 0);
+
+  private:
+    // Find best parameter vector and sum of costs in population
+    void findBest();
+
+    P *problem;
+    R *recombinator;
+    int np;              // Number of population members
+    int pos;             // Where we are going in population
+    double *population;  // Parameter vectors in population, one-by-one
+    double *costs;       // Costs of parameter vectors in population
+    double *_best;       // Pointer to best parameter vector in population
+    double bestcost;     // Cost of the above
+    double sumcost;      // Sum of all costs in population
+    double gencost;      // Sum of costs from 0..pos
+    uint64_t seed;       // Key of the random streams
+    uint32_t generation; // Number of completed generations
+    uint32_t seedings;   // Number of calls to seedPopulation
+  };
+
+  // Purposes of random streams, used as their last identifying number.
+  // Shared by the strategies so that they draw the same numbers.
+  enum {
+    INIT_STREAM,
+    EVOLVE_STREAM,
+    SEED_STREAM,
+    RESTART_STREAM
+  };
+
+  template <class P, class R, int D>
+  FixedDE<P, R, D>::FixedDE(P *problem, int np, R *recombinator, uint64_t seed)
+  {
+    assert(problem->getNumDimensions() == D);
+    this->problem = problem;
+    this->recombinator = recombinator;
+    recombinator->setNumDimensions(D);
+    this->np = np;
+    this->seed = seed;
+    generation = 0;
+    seedings = 0;
+    pos = 0;
+    gencost = 0;
+    population = new double[np*D];
+    costs = new double[np];
+    double *minx = problem->getMin();
+    double *maxx = problem->getMax();
+    for (int member = 0; member < np; member++) {
+      Philox stream(seed, member, 0, INIT_STREAM);
+      stream.fillUniform(&population[member*D], D);
+      for (int param = 0; param < D; param++) {
+	population[member*D+param] = population[member*D+param]*(maxx[param]-minx[param])+minx[param];
+      }
+      costs[member] = problem->P::costFunction(&population[member*D], DBL_MAX);
+      numEvaluations++;
+    }
+    findBest();
+  }
+
+  template <class P, class R, int D>
+  FixedDE<P, R, D>::~FixedDE()
+  {
+    delete[] population;
+    delete[] costs;
+  }
+
+  template <class P, class R, int D>
+  double *FixedDE<P, R, D>::best()
+  {
+    return _best;
+  }
+
+  template <class P, class R, int D>
+  double FixedDE<P, R, D>::averageCost()
+  {
+    return sumcost/np;
+  }
+
+  template <class P, class R, int D>
+  void FixedDE<P, R, D>::findBest()
+  {
+    _best = &population[0];
+    sumcost = 0;
+    bestcost = DBL_MAX;
+    for (int t = 0; t < np; t++) {
+      sumcost += costs[t];
+      if (costs[t] < bestcost) {
+	bestcost = costs[t];
+	_best = &population[t*D];
+      }
+    }
+  }
+
+  template <class P, class R, int D>
+  void FixedDE<P, R, D>::seedPopulation(double *minx, double *maxx, int num, int first)
+  {
+    if (first+num > np) num = np-first;
+    for (int member = first; member < first+num; member++) {
+      Philox stream(seed, member, seedings, SEED_STREAM);
+      stream.fillUniform(&population[member*D], D);
+      for (int param = 0; param < D; param++) {
+	population[member*D+param] = population[member*D+param]*(maxx[param]-minx[param])+minx[param];
+      }
+      costs[member] = problem->P::costFunction(&population[member*D], DBL_MAX);
+      numEvaluations++;
+    }
+    findBest();
+    seedings++;
+  }
+
+  template <class P, class R, int D>
+  double FixedDE<P, R, D>::evolve()
+  {
+    double trialvector[D];
+    double const *parents[R::NUM_PARENTS];
+    int picks[R::NUM_PARENTS-1];
+    // The first of the parents is the destination vector
+    parents[0] = &population[pos*D];
+    Philox stream(seed, pos, generation, EVOLVE_STREAM);
+    distinctRandom(picks, np, R::NUM_PARENTS-1, stream);
+    for (int t = 1; t < R::NUM_PARENTS; t++) {
+      parents[t] = &population[picks[t-1]*D];
+    }
+    recombinator->template recombineFixed<D>(trialvector, parents, stream);
+    double trialcost = problem->P::costFunction(trialvector, costs[pos]);
+    numEvaluations++;
+    if (trialcost < costs[pos]) {
+      for (int param = 0; param < D; param++) {
+	population[pos*D+param] = trialvector[param];
+      }
+      sumcost -= costs[pos];
+      costs[pos] = trialcost;
+      sumcost += trialcost;
+      if (trialcost < bestcost) {
+	bestcost = trialcost;
+	_best = &population[pos*D];
+      }
+    }
+    gencost += costs[pos];
+    if (++pos >= np) {
+      pos = 0;
+      generation++;
+      sumcost = gencost;
+      gencost = 0;
+    }
+    return bestcost;
+  }
+
 } // end namespace Opti
 
 #endif
@@ -2,126 +2,814 @@
 #include <math.h>
 #include "keyboard.h"
 #include "opti.hpp"
+#include "normproblem.hpp"
 #include <limits>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
-class NormProblem : public Opti::Problem {
-private:
-  int numParams;
-  int numSamples;
-  double *min;
-  double *max;
-  double *x;
-  double *y;
-  double error_multiplier;
-
-public:
-
-  // numParams must be odd
-  NormProblem(int numParams, int numSamples, double startX = 0.001, double endX = 1.0, double error_multiplier = 1.01, double* candidate = NULL) : numParams(numParams), numSamples(numSamples), error_multiplier(error_multiplier) {
-    min = new double[numParams];
-    max = new double[numParams];
-    x = new double[numSamples];
-    if (candidate != NULL) {
-      for (int i = 0; i < numParams; i++) {
-        min[i] = candidate[i]-fabs(candidate[i])*(1.0/65536);
-        max[i] = candidate[i]+fabs(candidate[i])*(1.0/65536);
-      }
-    } else {
-      for (int i = 0; i < numParams; i++) {
-        min[i] = -0.5;
-        max[i] = 0.5;
-      }
+// Print the best solution and export it as a header
+void printResult(NormProblem &problem, double *best) {
+  printf("Parameter vector printout:\n");
+  problem.print(best);
+  printf("Best cost %f\n", problem.costFunction(best, std::numeric_limits<double>::max()));
+  if (!problem.exportHeader(best)) {
+    printf("Could not export header\n");
+  }
+}
+
+// Print the Pareto front of error versus coefficient magnitude, one member
+// per line
+void printFront(Opti::NSGA2 &nsga2, NormProblem &problem) {
+  printf("Pareto front, max abs error vs max layer |a|+|b|+|c|:\n");
+  for (int i = 0; i < nsga2.getFrontSize(); i++) {
+    double const *costs = nsga2.getFrontCosts(i);
+    printf("%.20f %.6f ", costs[0], costs[1]);
+    problem.Opti::Problem::print(nsga2.getFrontVector(i));
+  }
+}
+
+// Error scenarios of the robust cost of the 5-layer problem, the first one
+// being the default model
+struct Scenarios {
+  int num;
+  double multipliers[NormProblem::MAX_SCENARIOS];
+  double noises[NormProblem::MAX_SCENARIOS];
+  double scales[NormProblem::MAX_SCENARIOS*5];
+};
+
+// Parse a scenario "M,E[,S1,...,S5]" into scenarios. Returns false if it
+// is malformed or there are too many.
+bool parseScenario(char const *text, Scenarios &scenarios) {
+  if (scenarios.num >= NormProblem::MAX_SCENARIOS) {
+    return false;
+  }
+  int s = scenarios.num;
+  double values[2+5];
+  int numValues = 0;
+  char *end;
+  for (;;) {
+    if (numValues == 2+5) {
+      return false;
     }
-    for (int i = 0; i < numSamples; i++) {
-      // x[i] = startX + (endX-startX)*i/(numSamples-1);  // Uniform sampling
-      x[i] = startX + (endX-startX)*(0.5 - 0.5*cos(M_PI*i/(numSamples-1)));  // Like Chebyshev nodes but including end points, to make MSE-optimimal similar to maxabs-error-optimal
+    values[numValues++] = strtod(text, &end);
+    if (end == text || (*end && *end != ',')) {
+      return false;
+    }
+    if (!*end) {
+      break;
+    }
+    text = end+1;
+  }
+  if (numValues < 2) {
+    return false;
+  }
+  scenarios.multipliers[s] = values[0];
+  scenarios.noises[s] = values[1];
+  for (int j = 0; j < 5; j++) {
+    scenarios.scales[s*5+j] = 2+j < numValues ? values[2+j] : 1.0;
+  }
+  scenarios.num++;
+  return true;
+}
+
+void applyScenarios(NormProblem &problem, Scenarios const &scenarios) {
+  if (scenarios.num > 1) {
+    problem.setScenarios(scenarios.num, scenarios.multipliers, scenarios.noises, scenarios.scales);
+  }
+}
+
+// Replace the samples of problem with numSamples samples placed and
+// weighted by spectrum
+void applySpectrum(NormProblem &problem, Spectrum &spectrum, int numSamples) {
+  double *x = new double[numSamples];
+  double *w = new double[numSamples];
+  spectrum.sampleSet(numSamples, x, w);
+  problem.setSamples(numSamples, x, w);
+  delete[] x;
+  delete[] w;
+}
+
+// Evaluate best on numSamples samples, typically many more than optimized
+// with, weighted by spectrum if not NULL, splitting the samples over pool
+void verifyResult(double *best, int numSamples, double startX, double endX, Spectrum *spectrum, Scenarios const &scenarios, Opti::ThreadPool *pool) {
+  NormProblem verifier(3*5, numSamples, startX, endX, 1.01);
+  if (spectrum) {
+    applySpectrum(verifier, *spectrum, numSamples);
+  }
+  applyScenarios(verifier, scenarios);
+  verifier.setThreadPool(pool);
+  double params[3*5];
+  memcpy(params, best, sizeof(params));
+  time_t startTime = time(NULL);
+  double cost = verifier.costFunction(params, std::numeric_limits<double>::max());
+  printf("Verified cost %.20f with %d samples on %d threads in %.0f s\n", cost, numSamples, pool->getNumThreads(), difftime(time(NULL), startTime));
+}
+
+// Store best in the archive if it beats the entry of this configuration.
+// Costs of weighted sample sets or of several error scenarios are not
+// comparable, so those are not stored.
+void archiveResult(Opti::Archive &archive, NormProblem &problem, double *best, long long evaluations, double seconds, uint64_t seed) {
+  if (!archive.isOpen() || problem.isWeighted() || problem.isRobust()) {
+    return;
+  }
+  double key[NormProblem::NUM_ARCHIVE_KEYS];
+  problem.archiveKey(key);
+  double cost = problem.costFunction(best, std::numeric_limits<double>::max());
+  if (archive.store(key, best, cost, evaluations, seconds, seed)) {
+    printf("Archived cost %.20f\n", cost);
+  }
+}
+
+// DE with periodic local refinement of its best member by Minimax steps
+struct Refinement {
+  NormProblem *problem;
+  Opti::DE *de;
+  Opti::Minimax *minimax;
+  int numSteps;
+};
+
+// Refine a copy of the best member of the DE, whose cost is given, and
+// inject it back if it improved
+void refineBest(Refinement &refinement, double cost) {
+  int d = refinement.problem->getNumDimensions();
+  double *vector = new double[d];
+  memcpy(vector, refinement.de->best(), d*sizeof(double));
+  double refinedCost = refinement.minimax->refine(vector, refinement.numSteps);
+  if (refinedCost < cost) {
+    refinement.de->inject(vector, refinedCost);
+  }
+  delete[] vector;
+}
+
+// Progress callback of batch runs with refinement
+bool refineProgress(void *context, long long evaluations, double bestcost) {
+  Refinement &refinement = *(Refinement *)context;
+  refineBest(refinement, bestcost);
+  printf("evaluations=%lld, bestcost=%.20f, average=%.20f\n", evaluations, bestcost, refinement.de->averageCost());
+  refinement.de->printStatistics();
+  refinement.minimax->printStatistics();
+  return true;
+}
+
+// Publishes improvements of the best solution for other processes
+struct Publisher {
+  Opti::Publication *publication;
+  Opti::ReducedProblem *reduced;    // The searched problem if reduced, else NULL
+};
+
+void publishBest(void *context, double const *best, double cost, long long evaluations) {
+  Publisher &publisher = *(Publisher *)context;
+  double full[3*5];
+  if (publisher.reduced) {
+    publisher.reduced->expand((double *)best, full);
+    best = full;
+  }
+  publisher.publication->publish(best, cost, evaluations);
+}
+
+// Creates the DE runs of Restarts, seeding a tenth of the population
+// around the elite and including the elite itself
+struct DEFactory {
+  Opti::Problem *problem;           // Searched problem
+  NormProblem *normProblem;
+  Opti::ReducedProblem *reduced;    // The searched problem if reduced, else NULL
+  Opti::Recombinator *recombinator;
+};
+
+Opti::Strategy *createDE(void *context, int populationSize, uint64_t seed, double const *elite, double eliteCost) {
+  DEFactory &factory = *(DEFactory *)context;
+  factory.normProblem->setCandidate(NULL);
+  Opti::DE *de = new Opti::DE(factory.problem, populationSize, factory.recombinator, seed);
+  if (elite) {
+    double full[3*5];
+    if (factory.reduced) {
+      factory.reduced->expand((double *)elite, full);
+    } else {
+      memcpy(full, elite, sizeof(full));
     }
+    factory.normProblem->setCandidate(full);
+    de->seedPopulation(factory.problem->getMin(), factory.problem->getMax(), populationSize/10, 0);
+    de->inject(elite, eliteCost);
   }
+  return de;
+}
+
+// Continuation from an easier start of the interval and error multiplier
+// to those of the problem. The start moves geometrically and the
+// multiplier linearly with the position.
+struct Ramp {
+  NormProblem *problem;
+  double startX, endX, multiplier;     // Target
+  double easyStartX, easyMultiplier;
+  int numSteps;
+  long long stepEvaluations;
+};
 
-  double *getMin() {
-    return min;
+// Parse "A,M[,N,E]" into the easy start A and multiplier M, the number of
+// steps N and the evaluations E of each. Returns false if it is malformed.
+bool parseRamp(char const *text, Ramp &ramp) {
+  double values[4] = {0, 0, 10, 100000};
+  int numValues = 0;
+  char *end;
+  for (;;) {
+    if (numValues == 4) {
+      return false;
+    }
+    values[numValues++] = strtod(text, &end);
+    if (end == text || (*end && *end != ',')) {
+      return false;
+    }
+    if (!*end) {
+      break;
+    }
+    text = end+1;
   }
+  ramp.easyStartX = values[0];
+  ramp.easyMultiplier = values[1];
+  ramp.numSteps = (int)values[2];
+  ramp.stepEvaluations = (long long)values[3];
+  return numValues >= 2 && ramp.easyStartX > 0 && ramp.numSteps > 0 && ramp.stepEvaluations > 0;
+}
 
-  double *getMax() {
-    return max;
+// Step callback of Opti::Continuation. The target is set exactly, so that
+// the result is archived under the configuration of the target.
+void rampStep(void *context, double position) {
+  Ramp &ramp = *(Ramp *)context;
+  if (position >= 1) {
+    ramp.problem->setParameters(ramp.startX, ramp.endX, ramp.multiplier);
+  } else {
+    double startX = exp(log(ramp.easyStartX) + (log(ramp.startX) - log(ramp.easyStartX))*position);
+    double multiplier = ramp.easyMultiplier + (ramp.multiplier - ramp.easyMultiplier)*position;
+    ramp.problem->setParameters(startX, ramp.endX, multiplier);
   }
+}
 
-  void print(double *params) {
-    printf("Printout:\n");
-    for (int i = 0; i < numParams; i += 3) {
-      printf("(");
-      for (int j = 0; j < 3; j++) {
-        printf("%.20f", params[i+j]);
-        if (j < 2) {
-          printf(", ");
+// Find the fewest layers whose cost meets limits.targetCost, optimizing
+// maxLayers, maxLayers-1, ... layers in turn with DE within limits. Each
+// layer count is seeded around its greedy schedule and around the previous
+// solution with its least harmful layer dropped. Prints the frontier of
+// cost versus layer count and exports each solution that meets the target.
+// Returns the fewest layers meeting the target, or 0 if none did. If
+// spectrum is not NULL, its sample set replaces the default samples.
+int fewestLayers(int maxLayers, double startX, double endX, int numSamples, Spectrum *spectrum, Opti::RunLimits limits, uint64_t seed, bool useArchive) {
+  Opti::DERecombinator deRecombinator(0.999, 0.76);
+  double *frontierCost = new double[maxLayers+1];
+  long long *frontierEvaluations = new long long[maxLayers+1];
+  double *frontierSeconds = new double[maxLayers+1];
+  double *previous = NULL;
+  int fewest = 0;
+  int layers;
+  for (layers = maxLayers; layers >= 1; layers--) {
+    int numParams = 3*layers;
+    NormProblem problem(numParams, numSamples, startX, endX, 1.01);
+    if (spectrum) {
+      applySpectrum(problem, *spectrum, numSamples);
+    }
+    Opti::DE de(&problem, 1000, &deRecombinator, seed);
+    double *candidate = new double[numParams];
+    printf("%d layers: greedy schedule cost %.20f\n", layers, problem.greedySchedule(candidate));
+    problem.setCandidate(candidate);
+    de.seedPopulation(problem.getMin(), problem.getMax(), 100, 0);
+    if (previous) {
+      // Drop each layer of the previous solution in turn and keep the best.
+      // The layers share the linear coefficient, so the rest stay valid.
+      double bestCost = std::numeric_limits<double>::max();
+      double *dropped = new double[numParams];
+      for (int drop = 0; drop <= layers; drop++) {
+        for (int j = 0, k = 0; j <= layers; j++) {
+          if (j != drop) {
+            memcpy(&dropped[3*k++], &previous[3*j], 3*sizeof(double));
+          }
+        }
+        double cost = problem.costFunction(dropped, bestCost);
+        if (cost < bestCost) {
+          bestCost = cost;
+          memcpy(candidate, dropped, numParams*sizeof(double));
         }
       }
-      printf("),\n");
+      delete[] dropped;
+      printf("%d layers: warm start cost %.20f\n", layers, bestCost);
+      problem.setCandidate(candidate);
+      de.seedPopulation(problem.getMin(), problem.getMax(), 100, 100);
+    }
+    delete[] candidate;
+    Opti::RunResult result = de.run(limits);
+    frontierCost[layers] = problem.costFunction(result.best, std::numeric_limits<double>::max());
+    frontierEvaluations[layers] = result.evaluations;
+    frontierSeconds[layers] = result.seconds;
+    printf("%d layers: cost %.20f after %lld evaluations in %f s\n", layers, frontierCost[layers], result.evaluations, result.seconds);
+    if (useArchive) {
+      char archiveName[256];
+      problem.archiveName(archiveName, sizeof(archiveName));
+      Opti::Archive archive(archiveName, numParams, NormProblem::NUM_ARCHIVE_KEYS);
+      archiveResult(archive, problem, result.best, result.evaluations, result.seconds, seed);
     }
-    printf("\n");
-    for (int i = 0; i < numParams; i += 3) {
-      for (int j = 0; j < 3; j++) {
-        printf(j < 2? "%.20f x^%d + " : "%.20f x^%d", params[i+j], j*2+1);
+    delete[] previous;
+    previous = new double[numParams];
+    memcpy(previous, result.best, numParams*sizeof(double));
+    if (frontierCost[layers] > limits.targetCost) {
+      break;
+    }
+    fewest = layers;
+    printResult(problem, result.best);
+  }
+  printf("Cost frontier for target %g:\n", limits.targetCost);
+  for (int k = maxLayers; k >= layers && k >= 1; k--) {
+    printf("  %2d layers  cost %.20f  %lld evaluations  %f s%s\n", k, frontierCost[k], frontierEvaluations[k], frontierSeconds[k], frontierCost[k] <= limits.targetCost ? "  meets target" : "");
+  }
+  if (fewest) {
+    printf("Fewest layers meeting the target: %d\n", fewest);
+  } else {
+    printf("No layer count up to %d meets the target\n", maxLayers);
+  }
+  delete[] previous;
+  delete[] frontierCost;
+  delete[] frontierEvaluations;
+  delete[] frontierSeconds;
+  return fewest;
+}
+
+// Without arguments, runs until ESC is pressed. Batch runs are given one
+// or more stopping criteria:
+//   --evaluations N   cost function evaluations
+//   --seconds S       wall-clock time
+//   --target C        best cost
+//   --stagnation N    evaluations without improvement
+// Options:
+//   --surrogate       pre-screen trials with a surrogate model
+//   --cache           skip trials equal to recently evaluated ones to within
+//                     rounding
+//   --profile         report hardware counters per evaluation (Linux)
+//   --generational    evolve and evaluate a whole generation at a time
+//   --reduced         search only the free parameters
+//   --fixed           use the compile-time specialized DE engine
+//   --np N            population size, default 1000
+//   --cr X, --c X     cross-over and difference weight of DE, default 0.999
+//                     and 0.76
+//   --sd1 X, --sd2 X  deviations of the PCX recombination of G3, default 0.1
+//   --g3              use G3 with parent-centric recombination instead of DE
+//   --families F      evolve F disjoint G3 families per step in parallel
+//   --split           split the samples of each evaluation over threads
+//   --threads N       threads for --families, --split and --continuation,
+//                     default one per hardware thread
+//   --verify N        evaluate the result with N samples at the end, split
+//                     over the threads
+//   --archive FILE    archive of best solutions, default norm_<layers>x5.archive
+//   --no-archive      do not seed from or store to the archive
+//   --publish NAME    publish each new best solution in the POSIX shared
+//                     memory segment NAME, e.g. /norm_5x5
+//   --interval A B    optimize over x in [A, B], default [0.001, 1]
+//   --samples N       number of samples, default 65537, or 4097 with --spectrum
+//   --spectrum FILE   place and weight the samples by recorded singular value
+//                     histograms; may be given more than once
+//   --scenario M,E[,S1,...,S5]
+//                     also minimize the error under error multiplier M,
+//                     additive noise E and layer output scales S1..S5 (default
+//                     1); may be given up to 7 times
+//   --pareto          evolve a Pareto front of error versus coefficient
+//                     magnitude with NSGA-II
+//   --minimax         refine the greedy schedule or the best nearest
+//                     archived solution by minimax steps using gradients
+//   --refine N        refine the best DE member by N minimax steps at each
+//                     progress report
+//   --restarts        restart DE when its population collapses or stagnates,
+//                     doubling the population size each time (IPOP)
+//   --bipop           like --restarts, alternating large doubling runs
+//                     with small runs (BIPOP)
+//   --continuation A,M[,N,E]
+//                     start from the easier interval start A and error
+//                     multiplier M and move to the target in N steps
+//                     (default 10) of E evaluations (default 100000),
+//                     rescoring the population after each
+//   --fewest-layers   find the fewest layers meeting --target, starting
+//                     from --max-layers K (default 5), with the other
+//                     limits applying to each layer count
+int main(int argc, char **argv) {
+  Opti::RunLimits limits;
+  bool batch = false;
+  bool useSurrogate = false;
+  bool useCache = false;
+  bool profile = false;
+  bool generational = false;
+  bool reduced = false;
+  bool fixed = false;
+  bool useG3 = false;
+  int numThreads = 0;
+  int numFamilies = 0;
+  bool split = false;
+  int populationSize = 1000;
+  double cr = 0.999, c = 0.76;
+  double sd1 = 0.1, sd2 = 0.1;
+  bool controls = false;  // Any of the above given
+  int verifySamples = 0;
+  Scenarios scenarios;
+  scenarios.num = 0;
+  parseScenario("1.01,0", scenarios);
+  char const *archiveFile = NULL;
+  bool useArchive = true;
+  char const *publishName = NULL;
+  double startX = 0.001;
+  double endX = 1.0;
+  bool fewest = false;
+  bool pareto = false;
+  bool useMinimax = false;
+  int refineSteps = 0;
+  bool useRestarts = false;
+  bool useContinuation = false;
+  Ramp ramp;
+  Opti::Restarts::Regime regime = Opti::Restarts::IPOP;
+  int maxLayers = 5;
+  int numSamples = 0;
+  Spectrum *spectrum = NULL;
+  char const **spectrumFiles = new char const *[argc];
+  int numSpectrumFiles = 0;
+  for (int i = 1; i < argc; i++) {
+    if (i+1 < argc && !strcmp(argv[i], "--evaluations")) {
+      limits.maxEvaluations = atoll(argv[++i]);
+      batch = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--seconds")) {
+      limits.maxSeconds = atof(argv[++i]);
+      batch = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--target")) {
+      limits.targetCost = atof(argv[++i]);
+      batch = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--stagnation")) {
+      limits.stagnationWindow = atoll(argv[++i]);
+      batch = true;
+    } else if (!strcmp(argv[i], "--surrogate")) {
+      useSurrogate = true;
+    } else if (!strcmp(argv[i], "--cache")) {
+      useCache = true;
+    } else if (!strcmp(argv[i], "--profile")) {
+      profile = true;
+    } else if (!strcmp(argv[i], "--generational")) {
+      generational = true;
+    } else if (!strcmp(argv[i], "--reduced")) {
+      reduced = true;
+    } else if (!strcmp(argv[i], "--fixed")) {
+      fixed = true;
+    } else if (!strcmp(argv[i], "--g3")) {
+      useG3 = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--threads")) {
+      numThreads = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--np")) {
+      populationSize = atoi(argv[++i]);
+      controls = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--cr")) {
+      cr = atof(argv[++i]);
+      controls = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--c")) {
+      c = atof(argv[++i]);
+      controls = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--sd1")) {
+      sd1 = atof(argv[++i]);
+      controls = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--sd2")) {
+      sd2 = atof(argv[++i]);
+      controls = true;
+    } else if (!strcmp(argv[i], "--split")) {
+      split = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--verify")) {
+      verifySamples = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--families")) {
+      numFamilies = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--archive")) {
+      archiveFile = argv[++i];
+    } else if (!strcmp(argv[i], "--no-archive")) {
+      useArchive = false;
+    } else if (i+1 < argc && !strcmp(argv[i], "--publish")) {
+      publishName = argv[++i];
+    } else if (i+2 < argc && !strcmp(argv[i], "--interval")) {
+      startX = atof(argv[++i]);
+      endX = atof(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--scenario")) {
+      if (!parseScenario(argv[++i], scenarios)) {
+        fprintf(stderr, "Bad or too many --scenario %s\n", argv[i]);
+        return 1;
       }
-      printf("\n");
-    }
-    printf("\n");
-  }
-
-  double costFunction(double *params, double compare) {
-    double maxAbsErr = 0.0;
-    params[0] = fabs(params[0]);
-    for (int j = 0; j*3 < numParams; j++) {
-      params[j*3] = params[0];
-    }
-    for (int i = 0; i < numSamples; i++) {
-      double y = x[i];
-      double y_plus_error = x[i];
-      for (int j = 0; j < numParams/3; j++) {
-        double orig_y = y;
-        double orig_y_plus_error = y_plus_error;
-        y = params[j*3]*y + params[j*3+1]*(y*(y*y)) + params[j*3+2]*(y*(y*y)*(y*y));
-        y_plus_error = params[j*3]*y_plus_error + params[j*3+1]*(y_plus_error*(y_plus_error*y_plus_error)) + params[j*3+2]*(y_plus_error*(y_plus_error*y_plus_error)*(y_plus_error*y_plus_error));
-        if (y_plus_error < y) {
-          std::swap(y, y_plus_error);
-        }
-        y_plus_error *= error_multiplier;
+    } else if (!strcmp(argv[i], "--pareto")) {
+      pareto = true;
+    } else if (!strcmp(argv[i], "--minimax")) {
+      useMinimax = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--refine")) {
+      refineSteps = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--restarts")) {
+      useRestarts = true;
+    } else if (!strcmp(argv[i], "--bipop")) {
+      useRestarts = true;
+      regime = Opti::Restarts::BIPOP;
+    } else if (i+1 < argc && !strcmp(argv[i], "--continuation")) {
+      if (!parseRamp(argv[++i], ramp)) {
+        fprintf(stderr, "Bad --continuation %s\n", argv[i]);
+        return 1;
       }
-      double absErr = std::max(fabs(y_plus_error - 1.0), fabs(y - 1.0));
-      if (absErr > maxAbsErr) {
-        maxAbsErr = absErr;
-        if (maxAbsErr > compare) {
-          return compare;
-        }
+      useContinuation = true;
+    } else if (!strcmp(argv[i], "--fewest-layers")) {
+      fewest = true;
+    } else if (i+1 < argc && !strcmp(argv[i], "--max-layers")) {
+      maxLayers = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--samples")) {
+      numSamples = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--spectrum")) {
+      spectrumFiles[numSpectrumFiles++] = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (fixed && (reduced || useSurrogate || profile || generational)) {
+    fprintf(stderr, "--fixed cannot be combined with other options\n");
+    return 1;
+  }
+  if (useG3 && (fixed || useSurrogate || generational)) {
+    fprintf(stderr, "--g3 cannot be combined with --fixed, --surrogate or --generational\n");
+    return 1;
+  }
+  if (useCache && (fixed || useG3 || pareto || useMinimax || useRestarts || fewest)) {
+    fprintf(stderr, "--cache needs the DE engine and cannot be combined with --fixed, --g3, --pareto, --minimax, --restarts or --fewest-layers\n");
+    return 1;
+  }
+  if (pareto && (fixed || useG3 || useSurrogate || generational || reduced || profile || fewest)) {
+    fprintf(stderr, "--pareto cannot be combined with other strategy options\n");
+    return 1;
+  }
+  if (useMinimax && (fixed || useG3 || pareto || useSurrogate || generational || reduced || profile || fewest || refineSteps)) {
+    fprintf(stderr, "--minimax cannot be combined with other strategy options\n");
+    return 1;
+  }
+  if (refineSteps && (fixed || useG3 || pareto || reduced || fewest)) {
+    fprintf(stderr, "--refine cannot be combined with --fixed, --g3, --pareto, --reduced or --fewest-layers\n");
+    return 1;
+  }
+  if (useRestarts && (fixed || useG3 || pareto || useMinimax || refineSteps || useSurrogate || generational || profile || fewest)) {
+    fprintf(stderr, "--restarts and --bipop cannot be combined with other strategy options\n");
+    return 1;
+  }
+  if (scenarios.num > 1 && (useMinimax || refineSteps || fewest)) {
+    fprintf(stderr, "--scenario cannot be combined with --minimax, --refine or --fewest-layers\n");
+    return 1;
+  }
+  if (useContinuation && (fixed || useG3 || pareto || useMinimax || useRestarts || fewest || scenarios.num > 1 || numSpectrumFiles > 0)) {
+    fprintf(stderr, "--continuation needs the DE engine and cannot be combined with --fixed, --g3, --pareto, --minimax, --restarts, --fewest-layers, --scenario or --spectrum\n");
+    return 1;
+  }
+  if (useContinuation && limits.stagnationWindow > 0 && limits.stagnationWindow <= ramp.numSteps*ramp.stepEvaluations) {
+    fprintf(stderr, "--stagnation must be longer than the --continuation ramp\n");
+    return 1;
+  }
+  if (populationSize < 10) {
+    fprintf(stderr, "--np must be at least 10\n");
+    return 1;
+  }
+  if (split && (numFamilies > 0 || fewest)) {
+    fprintf(stderr, "--split cannot be combined with --families or --fewest-layers\n");
+    return 1;
+  }
+  if (numSpectrumFiles > 0) {
+    spectrum = new Spectrum(startX, endX);
+    for (int i = 0; i < numSpectrumFiles; i++) {
+      if (!spectrum->load(spectrumFiles[i])) {
+        fprintf(stderr, "Could not read spectrum %s\n", spectrumFiles[i]);
+        delete spectrum;
+        delete[] spectrumFiles;
+        return 1;
       }
     }
-    return maxAbsErr;
-  } 
-
-  int getNumDimensions() {
-    return numParams;
+    if (spectrum->getTotal() <= 0) {
+      fprintf(stderr, "The spectrum is empty\n");
+      delete spectrum;
+      delete[] spectrumFiles;
+      return 1;
+    }
+    printf("Spectrum of %g singular values\n", spectrum->getTotal());
   }
-
-  ~NormProblem() {
-    delete[] min;
-    delete[] max;
-    delete[] x;
+  delete[] spectrumFiles;
+  if (numSamples <= 0) {
+    numSamples = spectrum ? 4097 : 65537;
+  } else if (numSamples < 16) {
+    fprintf(stderr, "--samples must be at least 16\n");
+    delete spectrum;
+    return 1;
+  }
+  uint64_t seed = Opti::randomSeed();
+  printf("Seed %llu\n", (unsigned long long)seed);
+  if (fewest) {
+    // Each layer count has its own archive file, so --archive cannot apply
+    if (limits.targetCost == -DBL_MAX || maxLayers < 1 || fixed || useG3 || reduced || publishName || archiveFile || useSurrogate || generational || profile || verifySamples > 0 || controls) {
+      fprintf(stderr, "--fewest-layers needs --target and cannot be combined with --fixed, --g3, --reduced, --publish, --archive, --surrogate, --generational, --profile, --verify, --np, --cr, --c, --sd1 or --sd2\n");
+      delete spectrum;
+      return 1;
+    }
+    if (!limits.maxEvaluations && !limits.maxSeconds && !limits.stagnationWindow) {
+      // Layer counts that cannot meet the target must stop somehow
+      limits.stagnationWindow = 100000;
+    }
+    limits.reportInterval = 10000;
+    int found = fewestLayers(maxLayers, startX, endX, numSamples, spectrum, limits, seed, useArchive);
+    delete spectrum;
+    return found ? 0 : 2;
+  }
+  NormProblem problem(3*5, numSamples, startX, endX, 1.01);  // Would also use cushion=0.029158505 but cushion is not implemented
+  if (spectrum) {
+    applySpectrum(problem, *spectrum, numSamples);
+  }
+  applyScenarios(problem, scenarios);
+  Opti::DERecombinator deRecombinator(cr, c);
+  Opti::ParameterMap map(problem.getNumDimensions());
+  problem.defineParameterMap(map);
+  Opti::ReducedProblem reducedProblem(&problem, &map);
+  Opti::Problem *searched = reduced ? (Opti::Problem *)&reducedProblem : &problem;
+  double greedy[3*5];
+  printf("Greedy schedule cost %.20f\n", problem.greedySchedule(greedy));
+  Opti::Strategy *optimizer;
+  Opti::DE *de = NULL;
+  Opti::FixedDE<NormProblem, Opti::DERecombinator, 3*5> *fixedDE = NULL;
+  Opti::G3 *g3 = NULL;
+  Opti::NSGA2 *nsga2 = NULL;
+  Opti::Minimax *minimax = NULL;
+  Opti::Restarts *restarts = NULL;
+  Opti::Continuation *continuation = NULL;
+  DEFactory deFactory = {searched, &problem, reduced ? &reducedProblem : NULL, &deRecombinator};
+  Opti::ThreadPool *pool = NULL;
+  if ((useG3 && numFamilies > 0) || split || verifySamples > 0 || useContinuation) {
+    pool = new Opti::ThreadPool(numThreads);
+  }
+  if (split) {
+    problem.setThreadPool(pool);
+    printf("Samples split over %d threads\n", pool->getNumThreads());
+  }
+  double start[3*5];
+  double startCost = DBL_MAX;
+  if (useMinimax) {
+    optimizer = NULL;  // Created below from the best starting point
+  } else if (pareto) {
+    optimizer = nsga2 = new Opti::NSGA2(&problem, populationSize, &deRecombinator, seed);
+  } else if (useG3) {
+    optimizer = g3 = new Opti::G3(searched, populationSize, new Opti::PCXRecombinator(3, sd1, sd2), 2, seed);
+    if (numFamilies > 0) {
+      g3->setParallel(pool, numFamilies);
+      printf("%d families on %d threads\n", numFamilies, pool->getNumThreads());
+    }
+  } else if (useRestarts) {
+    optimizer = restarts = new Opti::Restarts(createDE, &deFactory, searched->getNumDimensions(), populationSize, regime, seed);
+    de = (Opti::DE *)restarts->current();  // Seeded below
+  } else if (fixed) {
+    optimizer = fixedDE = new Opti::FixedDE<NormProblem, Opti::DERecombinator, 3*5>(&problem, populationSize, &deRecombinator, seed);
+  } else {
+    optimizer = de = new Opti::DE(searched, populationSize, &deRecombinator, seed);
+  }
+  int tenth = populationSize/10;
+  // Seed a tenth of the population around candidate, from member first on
+  // or, for Minimax, start from the cheapest candidate
+  auto seedAround = [&](double *candidate, int first) {
+    problem.setCandidate(candidate);
+    if (useMinimax) {
+      double cost = problem.costFunction(candidate, startCost);
+      if (cost < startCost) {
+        memcpy(start, candidate, sizeof(start));
+        startCost = cost;
+      }
+    } else if (g3) {
+      g3->seedPopulation(searched->getMin(), searched->getMax(), tenth, first+1);
+    } else if (nsga2) {
+      nsga2->seedPopulation(problem.getMin(), problem.getMax(), tenth, first);
+    } else if (fixedDE) {
+      fixedDE->seedPopulation(problem.getMin(), problem.getMax(), tenth, first);
+    } else {
+      de->seedPopulation(searched->getMin(), searched->getMax(), tenth, first);
+    }
+  };
+  memcpy(start, greedy, sizeof(start));  // In case no candidate has a finite cost
+  seedAround(greedy, 0);
+  // and another tenth around each of the nearest archived configurations
+  char archiveName[256];
+  problem.archiveName(archiveName, sizeof(archiveName));
+  Opti::Archive archive(useArchive ? (archiveFile ? archiveFile : archiveName) : NULL, problem.getNumDimensions(), NormProblem::NUM_ARCHIVE_KEYS);
+  if (useArchive && !archive.isOpen()) {
+    printf("Could not open archive %s\n", archiveFile ? archiveFile : archiveName);
+  }
+  double key[NormProblem::NUM_ARCHIVE_KEYS];
+  problem.archiveKey(key);
+  int nearest[4];
+  int numNearest = archive.isOpen() ? archive.nearest(key, nearest, 4) : 0;
+  for (int i = 0; i < numNearest; i++) {
+    double other[NormProblem::NUM_ARCHIVE_KEYS];
+    double params[3*5];
+    double cost = archive.getEntry(nearest[i], other, params);
+    printf("Seeding from archived x%g..%g e%g with cost %.20f\n", exp(other[0]), exp(other[1]), exp(other[2]), cost);
+    seedAround(params, tenth*(i+1));
+  }
+  if (useMinimax) {
+    optimizer = minimax = new Opti::Minimax(&problem, start);
+  } else if (refineSteps) {
+    minimax = new Opti::Minimax(&problem, greedy);
+  }
+  if (useContinuation) {
+    // With --split the problem splits its evaluations over the pool instead
+    ramp.problem = &problem;
+    ramp.startX = startX;
+    ramp.endX = endX;
+    ramp.multiplier = 1.01;
+    optimizer = continuation = new Opti::Continuation(de, rampStep, &ramp, ramp.numSteps, ramp.stepEvaluations, split ? NULL : pool);
+    printf("Continuation from x%g e%g in %d steps of %lld evaluations\n", ramp.easyStartX, ramp.easyMultiplier, ramp.numSteps, ramp.stepEvaluations);
+  }
+  Refinement refinement = {&problem, de, minimax, refineSteps};
+  Opti::Publication publication(publishName, problem.getNumDimensions(), true);
+  if (publishName && !publication.isOpen()) {
+    printf("Could not open shared memory %s\n", publishName);
+  }
+  Publisher publisher = {&publication, reduced ? &reducedProblem : NULL};
+  double publishedCost = DBL_MAX;
+  time_t startTime = time(NULL);
+  double full[3*5];
+  Opti::Surrogate surrogate;
+  if (useSurrogate) {
+    de->setSurrogate(&surrogate);
+  }
+  Opti::EvaluationCache cache;
+  if (useCache) {
+    de->setCache(&cache);
+  }
+  // Opening the counters enables them, so only when profiling
+  Opti::Profiler *profiler = NULL;
+  if (profile) {
+    profiler = new Opti::Profiler;
+    if (g3) {
+      g3->setProfiler(profiler);
+    } else {
+      de->setProfiler(profiler);
+    }
+  }
+  // Progress is reported about every 10000 trials
+  if (generational) {
+    de->setGenerational(true);
+  }
+  int reportInterval = generational || nsga2 ? 10 : minimax && !refineSteps ? 100 : g3 && numFamilies > 0 ? 10000/(2*numFamilies) + 1 : 10000;
+  if (batch) {
+    static const char *reasons[] = {"evaluations", "time", "target", "stagnation", "cancel"};
+    limits.reportInterval = reportInterval;
+    if (refineSteps) {
+      limits.progress = refineProgress;
+      limits.progressContext = &refinement;
+    }
+    if (publication.isOpen()) {
+      limits.improved = publishBest;
+      limits.improvedContext = &publisher;
+    }
+    Opti::RunResult result = optimizer->run(limits);
+    printf("Stopped by %s limit after %lld evaluations in %f s\n", reasons[result.reason], result.evaluations, result.seconds);
+    optimizer->printStatistics();
+    if (restarts) {
+      restarts->printRecords();
+    }
+    if (continuation && !continuation->atTarget()) {
+      printf("Stopped before the target, at continuation position %g\n", continuation->getPosition());
+    }
+    if (reduced) {
+      reducedProblem.expand(result.best, full);
+      result.best = full;
+    }
+    if (nsga2) {
+      printFront(*nsga2, problem);
+    }
+    printResult(problem, result.best);
+    archiveResult(archive, problem, result.best, result.evaluations, result.seconds, seed);
+    if (verifySamples > 0) {
+      verifyResult(result.best, verifySamples, startX, endX, spectrum, scenarios, pool);
+    }
+    if (minimax != optimizer) {
+      delete minimax;
+    }
+    delete optimizer;
+    delete profiler;
+    delete pool;
+    delete spectrum;
+    return 0;
   }
-};
-
-int main() {
   INITKEYBOARD;
-  NormProblem problem(3*5, 65537, 0.001, 1.0, 1.01);  // Would also use cushion=0.029158505 but cushion is not implemented
-  Opti::DERecombinator deRecombinator(0.999, 0.76);
-  Opti::DE optimizer(&problem, 1000, &deRecombinator);
   for(int t = 0;; t++) {
-    double bestcost = optimizer.evolve();
-    if (!(t % 10000)) {
-      printf("gen=%d, bestcost=%.20f, average=%.20f\n", t, bestcost, optimizer.averageCost());
+    double bestcost = optimizer->evolve();
+    if (bestcost < publishedCost && publication.isOpen()) {
+      publishBest(&publisher, optimizer->best(), bestcost, optimizer->evaluations());
+      publishedCost = bestcost;
+    }
+    if (!(t % reportInterval)) {
+      if (refineSteps) {
+        refineBest(refinement, bestcost);
+      }
+      printf("gen=%d, bestcost=%.20f, average=%.20f\n", t, bestcost, optimizer->averageCost());
+      optimizer->printStatistics();
+      if (refineSteps) {
+        minimax->printStatistics();
+      }
       if (kbhit()) {
-        printf("Parameter vector printout:\n");
-        problem.print(optimizer.best());
-        printf("Best cost %f\n", problem.costFunction(optimizer.best(), std::numeric_limits<double>::max()));
+        if (reduced) {
+          reducedProblem.expand(optimizer->best(), full);
+          printResult(problem, full);
+        } else {
+          printResult(problem, optimizer->best());
+        }
         if (getch() == 27) {
           break;
         }
@@ -130,9 +818,34 @@ int main() {
     }
   }
   DEINITKEYBOARD;
+  if (restarts) {
+    restarts->printRecords();
+  }
+  if (continuation && !continuation->atTarget()) {
+    printf("Stopped before the target, at continuation position %g\n", continuation->getPosition());
+  }
+  if (nsga2) {
+    printFront(*nsga2, problem);
+  }
+  if (reduced) {
+    reducedProblem.expand(optimizer->best(), full);
+  } else {
+    memcpy(full, optimizer->best(), sizeof(full));
+  }
+  archiveResult(archive, problem, full, optimizer->evaluations(), difftime(time(NULL), startTime), seed);
+  if (verifySamples > 0) {
+    verifyResult(full, verifySamples, startX, endX, spectrum, scenarios, pool);
+  }
+  if (minimax != optimizer) {
+    delete minimax;
+  }
+  delete optimizer;
+  delete profiler;
+  delete pool;
+  delete spectrum;
   return 0;
 }
 
 // Compile with:
 // g++ -g -O0 optimize.cpp opti.cpp
-// g++ optimize.cpp opti.cpp -ffast-math -march=native -O3 -Wno-unused-result
\ No newline at end of file
+// g++ optimize.cpp opti.cpp -ffast-math -march=native -O3 -Wno-unused-result -pthread
\ No newline at end of file
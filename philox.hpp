@@ -0,0 +1,251 @@
+#ifndef PHILOX_HPP
+#define PHILOX_HPP
+
+// COUNTER-BASED RANDOM NUMBER GENERATOR
+// Philox4x32-10 of [1]. The output is a pure function of a key and a
+// counter, so a stream can be created anywhere, in any order and in any
+// thread, from the numbers that identify it, for example (seed, individual,
+// generation). Runs using such streams are reproducible regardless of
+// scheduling, and there is no generator state to share or lock.
+//
+// Besides single numbers, buffers can be filled in bulk. The bulk functions
+// run the rounds of several blocks side by side in plain loops over lanes,
+// which the compiler vectorizes with -O3 -march=native (log, sin and cos of
+// normal deviates need -ffast-math for glibc's vector math library). Bounded
+// integers use Lemire's multiply-shift method [2], which is unbiased and
+// needs no division in the common case.
+//
+// This work is placed in the public domain / released under CC0.
+//
+// References:
+//
+// [1] Salmon, J. K., Moraes, M. A., Dror, R. O., and Shaw, D. E. (2011).
+// Parallel Random Numbers: As Easy as 1, 2, 3. Proceedings of SC11.
+//
+// [2] Lemire, D. (2019). Fast Random Integer Generation in an Interval.
+// ACM Transactions on Modeling and Computer Simulation, 29(1).
+
+#include <stdint.h>
+#include <math.h>
+
+namespace Opti {
+
+  class Philox {
+  public:
+    // Create the stream identified by seed and the numbers a, b, c,
+    // for example an individual, a generation and a purpose.
+    Philox(uint64_t seed, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0);
+
+    uint32_t randInt();            // integer in [0,2^32-1]
+    uint32_t randInt(uint32_t n);  // integer in [0,n]
+    uint32_t randBounded(uint32_t range);  // integer in [0,range-1], range > 0
+    double rand();                 // real number in [0,1]
+    double rand(double n);         // real number in [0,n]
+    double randExc();              // real number in [0,1)
+    double randDblExc();           // real number in (0,1)
+    double randNorm(double mean = 0.0, double stddev = 1.0);  // keeps the sine deviate for the next call
+
+    // Fill dest[0..num-1] in bulk. Draws whole blocks from the stream,
+    // independently of the words left over from the single number functions.
+    void fillUniform(double *dest, int num);  // [0,1)
+    void fillNormal(double *dest, int num);   // mean 0, sd 1
+
+    // Number of blocks computed side by side in the bulk functions
+    enum { LANES = 8 };
+
+    // The Philox4x32-10 bijection from counter to output
+    static void block(uint32_t const *key, uint32_t const *counter, uint32_t *output);
+
+  private:
+    // Compute numBlocks <= LANES consecutive blocks into output
+    void blocks(uint32_t *output, int numBlocks);
+
+    uint32_t key[2];
+    uint32_t counter[4];  // counter[0] counts blocks within the stream
+    uint32_t output[4];
+    int left;             // number of unused words in output
+    double spare;         // sine deviate of the last randNorm pair
+    bool hasSpare;
+  };
+
+  inline Philox::Philox(uint64_t seed, uint32_t a, uint32_t b, uint32_t c)
+  {
+    key[0] = (uint32_t)seed;
+    key[1] = (uint32_t)(seed >> 32);
+    counter[0] = 0;
+    counter[1] = a;
+    counter[2] = b;
+    counter[3] = c;
+    left = 0;
+    spare = 0;
+    hasSpare = false;
+  }
+
+  inline void Philox::block(uint32_t const *key, uint32_t const *counter, uint32_t *output)
+  {
+    uint32_t k0 = key[0], k1 = key[1];
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    for (int round = 0; round < 10; round++) {
+      uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+      uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+      uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+      uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+      c1 = (uint32_t)p1;
+      c3 = (uint32_t)p0;
+      c0 = n0;
+      c2 = n2;
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+    output[0] = c0;
+    output[1] = c1;
+    output[2] = c2;
+    output[3] = c3;
+  }
+
+  inline uint32_t Philox::randInt()
+  {
+    if (left == 0) {
+      block(key, counter, output);
+      counter[0]++;
+      left = 4;
+    }
+    return output[--left];
+  }
+
+  inline uint32_t Philox::randInt(uint32_t n)
+  {
+    // Draw numbers until one is found in [0,n], as in MTRand
+    uint32_t used = n;
+    used |= used >> 1;
+    used |= used >> 2;
+    used |= used >> 4;
+    used |= used >> 8;
+    used |= used >> 16;
+    uint32_t i;
+    do
+      i = randInt() & used;
+    while (i > n);
+    return i;
+  }
+
+  inline uint32_t Philox::randBounded(uint32_t range)
+  {
+    uint64_t m = (uint64_t)randInt() * range;
+    uint32_t l = (uint32_t)m;
+    if (l < range) {
+      uint32_t t = -range % range;
+      while (l < t) {
+	m = (uint64_t)randInt() * range;
+	l = (uint32_t)m;
+      }
+    }
+    return (uint32_t)(m >> 32);
+  }
+
+  inline double Philox::rand()
+  {
+    return double(randInt()) * (1.0/4294967295.0);
+  }
+
+  inline double Philox::rand(double n)
+  {
+    return rand() * n;
+  }
+
+  inline double Philox::randExc()
+  {
+    return double(randInt()) * (1.0/4294967296.0);
+  }
+
+  inline double Philox::randDblExc()
+  {
+    return (double(randInt()) + 0.5) * (1.0/4294967296.0);
+  }
+
+  inline double Philox::randNorm(double mean, double stddev)
+  {
+    // Box-Muller, returning the sine deviate on the next call
+    if (hasSpare) {
+      hasSpare = false;
+      return mean + spare * stddev;
+    }
+    double r = sqrt(-2.0 * log(1.0-randDblExc()));
+    double phi = 2.0 * 3.14159265358979323846264338328 * randExc();
+    spare = r * sin(phi);
+    hasSpare = true;
+    return mean + r * cos(phi) * stddev;
+  }
+
+  inline void Philox::blocks(uint32_t *output, int numBlocks)
+  {
+    uint32_t c0[LANES], c1[LANES], c2[LANES], c3[LANES];
+    for (int lane = 0; lane < LANES; lane++) {
+      c0[lane] = counter[0] + lane;
+      c1[lane] = counter[1];
+      c2[lane] = counter[2];
+      c3[lane] = counter[3];
+    }
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+      // Low and high halves of the products computed separately, which
+      // the compiler vectorizes as 32-bit and widening 64-bit multiplies
+      for (int lane = 0; lane < LANES; lane++) {
+	uint32_t hi0 = (uint32_t)(((uint64_t)0xD2511F53 * c0[lane]) >> 32);
+	uint32_t hi1 = (uint32_t)(((uint64_t)0xCD9E8D57 * c2[lane]) >> 32);
+	uint32_t lo0 = 0xD2511F53u * c0[lane];
+	uint32_t lo1 = 0xCD9E8D57u * c2[lane];
+	c0[lane] = hi1 ^ c1[lane] ^ k0;
+	c2[lane] = hi0 ^ c3[lane] ^ k1;
+	c1[lane] = lo1;
+	c3[lane] = lo0;
+      }
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+    for (int lane = 0; lane < numBlocks; lane++) {
+      output[lane*4] = c0[lane];
+      output[lane*4+1] = c1[lane];
+      output[lane*4+2] = c2[lane];
+      output[lane*4+3] = c3[lane];
+    }
+    counter[0] += numBlocks;
+  }
+
+  inline void Philox::fillUniform(double *dest, int num)
+  {
+    alignas(64) uint32_t buffer[4*LANES];
+    for (int first = 0; first < num; first += 4*LANES) {
+      int n = num - first < 4*LANES ? num - first : 4*LANES;
+      blocks(buffer, (n + 3)/4);
+      for (int i = 0; i < n; i++) {
+	dest[first+i] = double(buffer[i]) * (1.0/4294967296.0);
+      }
+    }
+  }
+
+  inline void Philox::fillNormal(double *dest, int num)
+  {
+    // Box-Muller, using both the cosine and the sine deviate of each pair
+    alignas(64) uint32_t buffer[4*LANES];
+    alignas(64) double pairs[4*LANES];
+    for (int first = 0; first < num; first += 4*LANES) {
+      int n = num - first < 4*LANES ? num - first : 4*LANES;
+      blocks(buffer, (n + 3)/4);
+      for (int i = 0; i < (n + 1)/2; i++) {
+	double u1 = (double(buffer[2*i]) + 0.5) * (1.0/4294967296.0);
+	double u2 = double(buffer[2*i+1]) * (1.0/4294967296.0);
+	double r = sqrt(-2.0 * log(u1));
+	double phi = 2.0 * 3.14159265358979323846264338328 * u2;
+	pairs[2*i] = r * cos(phi);
+	pairs[2*i+1] = r * sin(phi);
+      }
+      for (int i = 0; i < n; i++) {
+	dest[first+i] = pairs[i];
+      }
+    }
+  }
+
+} // end namespace Opti
+
+#endif
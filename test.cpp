@@ -1,10 +1,13 @@
 #include <stdio.h>
+#include "opti.hpp"
 
 int main() {
   // Set d to -nan
   double d = -0.0/0.0;
   printf("%d\n", d == d);
+  // Testing the exponent bits still detects it
+  printf("%d\n", Opti::isFinite(d));
   return 0;
 }
 
-// g++ test.cpp -ffast-math -march=native -O3 -Wno-unused-result
\ No newline at end of file
+// g++ test.cpp -ffast-math -march=native -O3 -Wno-unused-result
@@ -0,0 +1,249 @@
+// Scripted client test of normd. Starts the daemon given as the argument
+// (default ./normd) on temporary sockets and checks the protocol lines,
+// errors, priority order, the per-user quota and cancellation on
+// disconnect. Exits with 1 on failure.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+      printf("FAIL line %d: ", __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// Start the daemon with the given options on socketPath, logging to
+// logPath. Returns its pid.
+static pid_t startDaemon(const char *daemon, const char *socketPath, const char *workers, const char *quota, const char *logPath) {
+  unlink(socketPath);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    freopen(logPath, "w", stdout);
+    execl(daemon, daemon, "--socket", socketPath, "--workers", workers, "--quota", quota, "--no-archive", "--timeout", "1", (char *)NULL);
+    perror(daemon);
+    _exit(127);
+  }
+  // Wait for the socket to appear
+  for (int i = 0; i < 100 && access(socketPath, F_OK); i++) {
+    usleep(50000);
+  }
+  return pid;
+}
+
+static void stopDaemon(pid_t pid) {
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+static int connectTo(const char *socketPath) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketPath);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Connect and send text. Returns the connection.
+static int submit(const char *socketPath, const char *text) {
+  int fd = connectTo(socketPath);
+  if (fd >= 0 && write(fd, text, strlen(text)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Read a line without the newline within timeoutMs. Returns false on
+// timeout or end of connection.
+static bool readLine(int fd, char *line, int size, int timeoutMs) {
+  int length = 0;
+  for (;;) {
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, timeoutMs) <= 0) {
+      break;
+    }
+    if (read(fd, line+length, 1) != 1) {
+      break;
+    }
+    if (line[length] == '\n') {
+      line[length] = 0;
+      return true;
+    }
+    if (length < size-1) {
+      length++;
+    }
+  }
+  line[length] = 0;
+  return false;
+}
+
+// Read lines until one starts with prefix. Returns false on an error line,
+// timeout or end of connection.
+static bool expect(int fd, const char *prefix, int timeoutMs, char *line = NULL) {
+  char buffer[8192];
+  if (!line) {
+    line = buffer;
+  }
+  while (readLine(fd, line, sizeof(buffer), timeoutMs)) {
+    if (!strncmp(line, prefix, strlen(prefix))) {
+      return true;
+    }
+    if (!strncmp(line, "error ", 6)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// True if fd has a line starting with prefix within timeoutMs
+static bool arrives(int fd, const char *prefix, int timeoutMs) {
+  return expect(fd, prefix, timeoutMs);
+}
+
+static bool logContains(const char *logPath, const char *text) {
+  FILE *f = fopen(logPath, "r");
+  if (!f) {
+    return false;
+  }
+  char line[1024];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), f)) {
+    found = strstr(line, text) != NULL;
+  }
+  fclose(f);
+  return found;
+}
+
+static const char *SHORT = "layers=2 samples=257 seed=1";
+
+int main(int argc, char **argv) {
+  const char *daemon = argc > 1 ? argv[1] : "./normd";
+  char socketPath[64], logPath[64];
+  snprintf(socketPath, sizeof(socketPath), "/tmp/normd_test_%d.sock", (int)getpid());
+  snprintf(logPath, sizeof(logPath), "/tmp/normd_test_%d.log", (int)getpid());
+  char text[2048];
+  char line[8192];
+
+  // One worker
+  pid_t pid = startDaemon(daemon, socketPath, "1", "1", logPath);
+
+  // Protocol lines of a job
+  snprintf(text, sizeof(text), "job %s evaluations=20000 report=100\n", SHORT);
+  int fd = submit(socketPath, text);
+  CHECK(fd >= 0, "connect");
+  CHECK(readLine(fd, line, sizeof(line), 5000) && !strncmp(line, "queued ", 7), "queued, got '%s'", line);
+  CHECK(readLine(fd, line, sizeof(line), 5000) && !strncmp(line, "started ", 8), "started, got '%s'", line);
+  CHECK(readLine(fd, line, sizeof(line), 5000) && !strncmp(line, "progress ", 9), "progress, got '%s'", line);
+  CHECK(expect(fd, "result ", 30000, line), "result");
+  int numFields = 0;
+  for (char *token = strtok(line, " "); token; token = strtok(NULL, " ")) {
+    numFields++;
+  }
+  CHECK(numFields == 6+3*2, "result with 6 parameters, got %d fields", numFields);
+  CHECK(!readLine(fd, line, sizeof(line), 5000), "connection closed after result");
+  close(fd);
+
+  // Errors
+  struct {
+    const char *text;
+    const char *answer;
+  } errors[] = {
+    {"hello\n", "error expected job"},
+    {"job layers=0\n", "error layers must be 1..64"},
+    {"job samples=2000000000\n", "error samples must be 16..1048577"},
+    {"job color=red\n", "error unknown key"},
+    {"job samples\n", "error expected key=value"},
+    {"job start=1 end=0.5\n", "error need 0 < start < end"},
+  };
+  for (int i = 0; i < (int)(sizeof(errors)/sizeof(errors[0])); i++) {
+    fd = submit(socketPath, errors[i].text);
+    CHECK(readLine(fd, line, sizeof(line), 5000) && !strcmp(line, errors[i].answer), "'%s' answered '%s'", errors[i].answer, line);
+    close(fd);
+  }
+  memset(text, 'x', sizeof(text)-2);
+  memcpy(text, "job ", 4);
+  text[sizeof(text)-2] = '\n';
+  text[sizeof(text)-1] = 0;
+  fd = submit(socketPath, text);
+  CHECK(readLine(fd, line, sizeof(line), 5000) && !strcmp(line, "error line too long"), "too long answered '%s'", line);
+  close(fd);
+  fd = submit(socketPath, "job layers=2");
+  CHECK(readLine(fd, line, sizeof(line), 5000) && !strcmp(line, "error timeout"), "timeout answered '%s'", line);
+  close(fd);
+
+  // Priority: while a blocker runs, a later job of higher priority is
+  // started before an earlier one of lower priority
+  snprintf(text, sizeof(text), "job %s seconds=1\n", SHORT);
+  int blocker = submit(socketPath, text);
+  CHECK(expect(blocker, "started ", 5000), "blocker started");
+  snprintf(text, sizeof(text), "job %s seconds=0.5 priority=0\n", SHORT);
+  int low = submit(socketPath, text);
+  CHECK(expect(low, "queued ", 5000), "low queued");
+  snprintf(text, sizeof(text), "job %s seconds=0.5 priority=5\n", SHORT);
+  int high = submit(socketPath, text);
+  CHECK(expect(high, "queued ", 5000), "high queued");
+  CHECK(expect(blocker, "result ", 10000), "blocker result");
+  CHECK(expect(high, "started ", 5000), "high started");
+  CHECK(!arrives(low, "started ", 200), "low started while high runs");
+  CHECK(expect(high, "result ", 10000), "high result");
+  CHECK(expect(low, "started ", 5000), "low started after high");
+  CHECK(expect(low, "result ", 10000), "low result");
+  close(blocker);
+  close(low);
+  close(high);
+
+  // Cancellation: a client that disconnects frees the worker at the next
+  // progress report
+  snprintf(text, sizeof(text), "job %s seconds=60 report=100\n", SHORT);
+  fd = submit(socketPath, text);
+  CHECK(expect(fd, "started ", 5000), "long job started");
+  close(fd);
+  snprintf(text, sizeof(text), "job %s evaluations=1000\n", SHORT);
+  fd = submit(socketPath, text);
+  CHECK(expect(fd, "started ", 5000), "next job started after cancellation");
+  CHECK(expect(fd, "result ", 10000), "next job result");
+  close(fd);
+  CHECK(logContains(logPath, "stopped by cancel limit"), "cancellation logged");
+  stopDaemon(pid);
+
+  // Quota: with two workers and a quota of one, a user's second job waits
+  // for the first
+  pid = startDaemon(daemon, socketPath, "2", "1", logPath);
+  snprintf(text, sizeof(text), "job %s seconds=1\n", SHORT);
+  int first = submit(socketPath, text);
+  CHECK(expect(first, "started ", 5000), "first started");
+  int second = submit(socketPath, text);
+  CHECK(expect(second, "queued ", 5000), "second queued");
+  CHECK(!arrives(second, "started ", 500), "second started over quota");
+  CHECK(expect(first, "result ", 10000), "first result");
+  CHECK(expect(second, "started ", 5000), "second started after first");
+  CHECK(expect(second, "result ", 10000), "second result");
+  close(first);
+  close(second);
+  stopDaemon(pid);
+
+  unlink(socketPath);
+  unlink(logPath);
+  printf("%s\n", failures ? "FAIL" : "OK");
+  return failures ? 1 : 0;
+}
+
+// g++ test_normd.cpp -O2 -o test_normd && ./test_normd ./normd
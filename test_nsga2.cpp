@@ -0,0 +1,84 @@
+// Checks that no member of the NSGA2 front is dominated by another member
+// of it, on the two-objective ZDT1 problem. Exits with 1 on failure.
+
+#include <stdio.h>
+#include <math.h>
+#include "opti.hpp"
+
+class ZDT1 : public Opti::Problem {
+public:
+  enum { D = 5 };
+  double min[D], max[D];
+
+  ZDT1() {
+    for (int i = 0; i < D; i++) {
+      min[i] = 0;
+      max[i] = 1;
+    }
+  }
+
+  int getNumDimensions() {
+    return D;
+  }
+
+  double *getMin() {
+    return min;
+  }
+
+  double *getMax() {
+    return max;
+  }
+
+  int getNumObjectives() {
+    return 2;
+  }
+
+  void costVector(double *params, double *costs) {
+    for (int i = 0; i < D; i++) {
+      params[i] = params[i] < 0 ? 0 : params[i] > 1 ? 1 : params[i];
+    }
+    double g = 0;
+    for (int i = 1; i < D; i++) {
+      g += params[i];
+    }
+    g = 1 + 9*g/(D-1);
+    costs[0] = params[0];
+    costs[1] = g*(1 - sqrt(params[0]/g));
+  }
+
+  double costFunction(double *params, double) {
+    double costs[2];
+    costVector(params, costs);
+    return costs[0];
+  }
+};
+
+int main() {
+  ZDT1 problem;
+  Opti::DERecombinator recombinator(0.9, 0.5);
+  Opti::NSGA2 nsga2(&problem, 200, &recombinator, 12345);
+  int failures = 0;
+  for (int generation = 0; generation < 20; generation++) {
+    nsga2.evolve();
+    int size = nsga2.getFrontSize();
+    int dominated = 0;
+    for (int i = 0; i < size; i++) {
+      double const *a = nsga2.getFrontCosts(i);
+      for (int j = 0; j < size; j++) {
+        double const *b = nsga2.getFrontCosts(j);
+        if (b[0] <= a[0] && b[1] <= a[1] && (b[0] < a[0] || b[1] < a[1])) {
+          dominated++;
+          break;
+        }
+      }
+    }
+    if (dominated) {
+      printf("generation %d: %d of %d front members dominated\n", generation, dominated, size);
+      failures++;
+    }
+  }
+  printf("%s\n", failures ? "FAIL" : "OK");
+  return failures ? 1 : 0;
+}
+
+// g++ test_nsga2.cpp opti.cpp -ffast-math -march=native -O3 -Wno-unused-result -pthread
@@ -0,0 +1,339 @@
+// Racing tuner of the control parameters of DE and G3 for one NormProblem
+// configuration. The settings are the population size np, the cross-over
+// probability cr and the difference weight c of DERecombinator, and the
+// deviations sd1 and sd2 of PCXRecombinator. Each setting is scored by
+// the evaluations it takes to reach a target cost, or twice the budget if
+// it does not get there (PAR2).
+//
+// The search is iterated racing as in irace [1]. Each iteration races a set
+// of settings: all of them are run on the same random seeds, one seed
+// after another, in parallel, and after a few seeds a setting is
+// eliminated once a paired t-test finds it slower than the best one. The
+// survivors become the elites of the next iteration, and the new settings
+// of that iteration are sampled around them with a spread that shrinks
+// each iteration. The first iteration starts from the defaults of optimize
+// and uniform samples. Runs are deterministic given their seed, so the
+// elites keep their results. Prints the elites and their optimize options.
+//
+// This work is placed in the public domain / CC0.
+//
+// References:
+//
+// [1] Lopez-Ibanez, M., Dubois-Lacoste, J., Perez Caceres, L., Birattari,
+// M., and Stutzle, T. (2016). The irace package: Iterated racing for
+// automatic algorithm configuration. Operations Research Perspectives, 3,
+// 43-58.
+
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include "opti.hpp"
+#include "normproblem.hpp"
+
+// A parameter of a setting, searched in [0,1] and mapped to [low, high]
+// linearly or logarithmically
+struct Range {
+  const char *name;
+  double low;
+  double high;
+  bool logarithmic;
+};
+
+enum { NUM_TUNED = 3 };
+
+// Ranges of np, cr and c for DE, and of np, sd1 and sd2 for G3
+static const Range ranges[2][NUM_TUNED] = {
+  {{"np", 20, 2000, true}, {"cr", 0.1, 1.0, false}, {"c", 0.2, 1.2, false}},
+  {{"np", 20, 2000, true}, {"sd1", 0.01, 1.0, true}, {"sd2", 0.01, 1.0, true}}
+};
+
+struct Setting {
+  bool g3;
+  double u[NUM_TUNED];          // Parameters mapped to [0,1]
+  std::vector<double> results;  // Score on each seed raced so far
+  bool alive;
+
+  double value(int p) const {
+    Range const &range = ranges[g3][p];
+    if (range.logarithmic) {
+      return range.low*pow(range.high/range.low, u[p]);
+    }
+    return range.low + (range.high - range.low)*u[p];
+  }
+
+  int populationSize() const {
+    return (int)(value(0) + 0.5);
+  }
+
+  // Mean score over the first num seeds
+  double mean(int num) const {
+    double sum = 0;
+    for (int i = 0; i < num; i++) {
+      sum += results[i];
+    }
+    return sum/num;
+  }
+
+  void print() const {
+    printf("%s--np %d", g3 ? "--g3 " : "", populationSize());
+    for (int p = 1; p < NUM_TUNED; p++) {
+      printf(" --%s %.4g", ranges[g3][p].name, value(p));
+    }
+  }
+};
+
+// The NormProblem configuration and the limits of each run
+struct Tuning {
+  int layers;
+  double startX;
+  double endX;
+  int samples;
+  double target;
+  long long budget;
+  uint64_t seed;
+};
+
+// Map value to [0,1] in range
+static double unit(Range const &range, double value) {
+  if (range.logarithmic) {
+    return log(value/range.low)/log(range.high/range.low);
+  }
+  return (value - range.low)/(range.high - range.low);
+}
+
+// Evaluations that setting takes to reach the target on the given seed,
+// counting the initial population, or twice the budget
+static double race(Setting const &setting, int instance, Tuning const &tuning) {
+  int numParams = 3*tuning.layers;
+  NormProblem problem(numParams, tuning.samples, tuning.startX, tuning.endX, 1.01);
+  Opti::Philox stream(tuning.seed, instance, 0, Opti::SEED_STREAM);
+  uint64_t seed = (uint64_t)stream.randInt() << 32;
+  seed |= stream.randInt();
+  int np = setting.populationSize();
+  Opti::DERecombinator deRecombinator(setting.value(1), setting.value(2));
+  Opti::Strategy *strategy;
+  double *greedy = new double[numParams];
+  problem.greedySchedule(greedy);
+  if (setting.g3) {
+    Opti::G3 *g3 = new Opti::G3(&problem, np, new Opti::PCXRecombinator(3, setting.value(1), setting.value(2)), 2, seed);
+    problem.setCandidate(greedy);
+    g3->seedPopulation(problem.getMin(), problem.getMax(), np/10, 1);
+    strategy = g3;
+  } else {
+    Opti::DE *de = new Opti::DE(&problem, np, &deRecombinator, seed);
+    problem.setCandidate(greedy);
+    de->seedPopulation(problem.getMin(), problem.getMax(), np/10);
+    strategy = de;
+  }
+  delete[] greedy;
+  Opti::RunLimits limits;
+  limits.targetCost = tuning.target;
+  limits.maxEvaluations = tuning.budget;
+  Opti::RunResult result = strategy->run(limits);
+  double score = result.reason == Opti::STOP_TARGET ? strategy->evaluations() : 2.0*tuning.budget;
+  delete strategy;
+  return score;
+}
+
+// One-sided 95 % critical values of Student's t by degrees of freedom
+static double tCritical(int dof) {
+  static const double table[30] = {
+    6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+    1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725,
+    1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697
+  };
+  return dof <= 30 ? table[dof-1] : 1.645;
+}
+
+// Eliminate the settings that a paired t-test on the first num seeds finds
+// slower than the one of the lowest mean score
+static void eliminate(std::vector<Setting> &settings, int num) {
+  int best = -1;
+  for (int s = 0; s < (int)settings.size(); s++) {
+    if (settings[s].alive && (best < 0 || settings[s].mean(num) < settings[best].mean(num))) {
+      best = s;
+    }
+  }
+  for (int s = 0; s < (int)settings.size(); s++) {
+    if (!settings[s].alive || s == best) {
+      continue;
+    }
+    double sum = 0, sumSquares = 0;
+    for (int i = 0; i < num; i++) {
+      double difference = settings[s].results[i] - settings[best].results[i];
+      sum += difference;
+      sumSquares += difference*difference;
+    }
+    double mean = sum/num;
+    double variance = (sumSquares - sum*mean)/(num-1);
+    if (variance <= 0 ? mean > 0 : mean/sqrt(variance/num) > tCritical(num-1)) {
+      settings[s].alive = false;
+    }
+  }
+}
+
+// Options:
+//   --target C        cost the runs race to reach (required)
+//   --budget N        evaluations per run, default 200000
+//   --configs K       settings raced per iteration, default 24
+//   --iterations I    iterations of racing, default 3
+//   --instances M     most seeds per race, default 20
+//   --first-test N    seeds before the first elimination, default 4
+//   --elites E        survivors kept for the next iteration, default 4
+//   --strategy S      de, g3 or both (default)
+//   --layers L        number of layers, default 5
+//   --interval A B    x interval, default [0.001, 1]
+//   --samples N       number of samples, default 65537
+//   --threads N       runs in parallel, default one per hardware thread
+//   --seed S          seed of the tuner, default random
+int main(int argc, char **argv) {
+  Tuning tuning = {5, 0.001, 1.0, 65537, -DBL_MAX, 200000, Opti::randomSeed()};
+  int numConfigs = 24;
+  int numIterations = 3;
+  int maxInstances = 20;
+  int firstTest = 4;
+  int numElites = 4;
+  bool tuneDE = true;
+  bool tuneG3 = true;
+  int numThreads = 0;
+  for (int i = 1; i < argc; i++) {
+    if (i+1 < argc && !strcmp(argv[i], "--target")) {
+      tuning.target = atof(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--budget")) {
+      tuning.budget = atoll(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--configs")) {
+      numConfigs = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--iterations")) {
+      numIterations = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--instances")) {
+      maxInstances = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--first-test")) {
+      firstTest = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--elites")) {
+      numElites = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--strategy")) {
+      i++;
+      tuneDE = strcmp(argv[i], "g3") != 0;
+      tuneG3 = strcmp(argv[i], "de") != 0;
+    } else if (i+1 < argc && !strcmp(argv[i], "--layers")) {
+      tuning.layers = atoi(argv[++i]);
+    } else if (i+2 < argc && !strcmp(argv[i], "--interval")) {
+      tuning.startX = atof(argv[++i]);
+      tuning.endX = atof(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--samples")) {
+      tuning.samples = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--threads")) {
+      numThreads = atoi(argv[++i]);
+    } else if (i+1 < argc && !strcmp(argv[i], "--seed")) {
+      tuning.seed = strtoull(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (tuning.target == -DBL_MAX || tuning.budget <= 0 || tuning.layers < 1 || tuning.samples < 16) {
+    fprintf(stderr, "--target is required, and --budget, --layers and --samples must be positive\n");
+    return 1;
+  }
+  if (firstTest < 2 || maxInstances < firstTest || numElites < 1 || numConfigs < numElites) {
+    fprintf(stderr, "Need 2 <= --first-test <= --instances and 1 <= --elites <= --configs\n");
+    return 1;
+  }
+  Opti::ThreadPool pool(numThreads);
+  printf("Seed %llu, %d threads\n", (unsigned long long)tuning.seed, pool.getNumThreads());
+  Opti::Philox stream(tuning.seed, 0, 0, Opti::INIT_STREAM);
+  std::vector<Setting> settings;
+  // The defaults of optimize
+  if (tuneDE) {
+    Setting setting = {false, {unit(ranges[0][0], 1000), unit(ranges[0][1], 0.999), unit(ranges[0][2], 0.76)}, {}, true};
+    settings.push_back(setting);
+  }
+  if (tuneG3) {
+    Setting setting = {true, {unit(ranges[1][0], 1000), unit(ranges[1][1], 0.1), unit(ranges[1][2], 0.1)}, {}, true};
+    settings.push_back(setting);
+  }
+  for (int iteration = 0; iteration < numIterations; iteration++) {
+    // Fill up with new settings, uniform at first, then around an elite
+    // chosen with weights decreasing by rank
+    int numElitesNow = settings.size();
+    double spread = 0.5/(iteration+1);
+    while ((int)settings.size() < numConfigs) {
+      Setting setting;
+      if (iteration == 0) {
+        setting.g3 = tuneG3 && (!tuneDE || stream.randInt(1));
+        for (int p = 0; p < NUM_TUNED; p++) {
+          setting.u[p] = stream.randExc();
+        }
+      } else {
+        double total = numElitesNow*(numElitesNow+1)/2.0;
+        double pick = stream.randExc()*total;
+        int parent = 0;
+        while (parent < numElitesNow-1 && (pick -= numElitesNow-parent) >= 0) {
+          parent++;
+        }
+        setting.g3 = settings[parent].g3;
+        for (int p = 0; p < NUM_TUNED; p++) {
+          setting.u[p] = std::min(1.0, std::max(0.0, stream.randNorm(settings[parent].u[p], spread)));
+        }
+      }
+      setting.alive = true;
+      settings.push_back(setting);
+    }
+    // Race the settings seed by seed
+    int instance;
+    for (instance = 0; instance < maxInstances; instance++) {
+      std::vector<int> pending;
+      for (int s = 0; s < (int)settings.size(); s++) {
+        if (settings[s].alive && (int)settings[s].results.size() <= instance) {
+          settings[s].results.resize(instance+1);
+          pending.push_back(s);
+        }
+      }
+      pool.parallelFor(pending.size(), [&](int i) {
+        settings[pending[i]].results[instance] = race(settings[pending[i]], instance, tuning);
+      });
+      int numAlive = 0;
+      if (instance+1 >= firstTest) {
+        eliminate(settings, instance+1);
+      }
+      for (int s = 0; s < (int)settings.size(); s++) {
+        numAlive += settings[s].alive;
+      }
+      printf("Iteration %d, seed %d: %d runs, %d settings left\n", iteration, instance, (int)pending.size(), numAlive);
+      if (numAlive <= 1 && instance+1 >= firstTest) {
+        instance++;
+        break;
+      }
+    }
+    // The survivors of lowest mean score are the elites
+    std::vector<Setting> elites;
+    for (int s = 0; s < (int)settings.size(); s++) {
+      if (settings[s].alive) {
+        elites.push_back(settings[s]);
+      }
+    }
+    int num = instance;
+    std::sort(elites.begin(), elites.end(), [&](Setting const &a, Setting const &b) { return a.mean(num) < b.mean(num); });
+    if ((int)elites.size() > numElites) {
+      elites.resize(numElites);
+    }
+    printf("Elites of iteration %d, mean evaluations to target over %d seeds:\n", iteration, num);
+    for (int e = 0; e < (int)elites.size(); e++) {
+      int reached = 0;
+      for (int i = 0; i < num; i++) {
+        reached += elites[e].results[i] < 2.0*tuning.budget;
+      }
+      printf("%12.0f  %d/%d reached  ", elites[e].mean(num), reached, num);
+      elites[e].print();
+      printf("\n");
+    }
+    settings = elites;
+  }
+  printf("Fastest settings, as options of optimize:\n");
+  settings[0].print();
+  printf("\n");
+  return 0;
+}
+
+// Compile with:
+// g++ tune.cpp opti.cpp -ffast-math -march=native -O3 -Wno-unused-result -pthread -o tune